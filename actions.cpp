@@ -19,14 +19,21 @@
 
 #include "actions.h"
 
+#include <QDBusArgument>
 #include <QDBusConnection>
 #include <QDBusMessage>
 #include <QDBusPendingCallWatcher>
 #include <QDBusPendingReply>
 #include <QDebug>
+#include <QHash>
+#include <QPair>
 #include <QStringList>
+#include <QTimer>
 #include <QVariantList>
 
+#include "signaldispatcher.h"
+#include "utils.h"
+
 static const QString s_orgGtkActions = QStringLiteral("org.gtk.Actions");
 
 Actions::Actions(const QString &serviceName, const QString &objectPath, QObject *parent) : QObject(parent)
@@ -36,19 +43,94 @@ Actions::Actions(const QString &serviceName, const QString &objectPath, QObject
     Q_ASSERT(!serviceName.isEmpty());
     Q_ASSERT(!m_objectPath.isEmpty());
 
-    if (!QDBusConnection::sessionBus().connect(serviceName,
-                                            objectPath,
-                                            s_orgGtkActions,
-                                            QStringLiteral("Changed"),
-                                            this,
-                                            SLOT(onActionsChanged(QStringList,StringBoolMap,QVariantMap,GMenuActionMap)))) {
-        qDebug() << "Failed to subscribe to action changes for" << parent << "on" << serviceName << "at" << objectPath;
-    }
+    m_activateTemplate = QDBusMessage::createMethodCall(m_serviceName,
+                                                        m_objectPath,
+                                                        s_orgGtkActions,
+                                                        QStringLiteral("Activate"));
+
+    m_atoms = Utils::AtomTable::forService(m_serviceName);
+
+    m_signalDispatcher = SignalDispatcher::forService(m_serviceName);
+    m_signalDispatcher->addHandler(this, m_objectPath, s_orgGtkActions, [this](const QDBusMessage &message) {
+        const QVariantList args = message.arguments();
+        if (args.count() != 4) {
+            qDebug() << "Ignoring action changes with unexpected signature" << message.signature() << "on" << m_serviceName << "at" << m_objectPath;
+            return;
+        }
+
+        onActionsChanged(qdbus_cast<QStringList>(args.at(0)),
+                         qdbus_cast<StringBoolMap>(args.at(1)),
+                         qdbus_cast<QVariantMap>(args.at(2)),
+                         qdbus_cast<GMenuActionMap>(args.at(3)));
+    });
+}
+
+Actions::~Actions()
+{
+    m_signalDispatcher->removeHandlers(this);
 }
 
-Actions::~Actions() = default;
+QSharedPointer<Actions> Actions::shared(const QString &serviceName, const QString &objectPath)
+{
+    static QHash<QPair<QString, QString>, QWeakPointer<Actions>> s_actions;
+
+    return Utils::sharedInstance(s_actions, qMakePair(serviceName, objectPath), [&] {
+        return new Actions(serviceName, objectPath);
+    });
+}
 
 void Actions::load()
+{
+    // everyone sharing us gets told through loaded() anyway
+    if (m_loading) {
+        return;
+    }
+    m_loading = true;
+
+    // above this many actions only the ones shown get described; off unless asked for, as finding out
+    // costs a List round trip before DescribeAll for the many applications below it
+    static const int s_lazyThreshold = qEnvironmentVariableIntValue("GLOBALMENU_LAZY_ACTIONS_THRESHOLD");
+
+    if (s_lazyThreshold <= 0) {
+        loadAll();
+        return;
+    }
+
+    // the names alone are cheap, see whether DescribeAll is worth it
+    QDBusMessage msg = QDBusMessage::createMethodCall(m_serviceName,
+                                                    m_objectPath,
+                                                    s_orgGtkActions,
+                                                    QStringLiteral("List"));
+
+    QDBusPendingReply<QStringList> reply = QDBusConnection::sessionBus().asyncCall(msg);
+    QDBusPendingCallWatcher *watcher = new QDBusPendingCallWatcher(reply, this);
+    connect(watcher, &QDBusPendingCallWatcher::finished, this, [this](QDBusPendingCallWatcher *watcher) {
+        QDBusPendingReply<QStringList> reply = *watcher;
+        watcher->deleteLater();
+
+        if (reply.isError() || reply.value().count() <= s_lazyThreshold) {
+            loadAll();
+            return;
+        }
+
+        const QStringList names = reply.value();
+        qDebug() << "Loading" << names.count() << "actions from" << m_serviceName << "at" << m_objectPath << "on demand";
+
+        m_lazy = true;
+        m_actions.clear();
+        m_available.clear();
+        m_available.reserve(names.count());
+        for (const QString &name : names) {
+            m_available.insert(m_atoms->atom(name));
+        }
+
+        m_loading = false;
+        m_loaded = true;
+        emit loaded();
+    });
+}
+
+void Actions::loadAll()
 {
     QDBusMessage msg = QDBusMessage::createMethodCall(m_serviceName,
                                                     m_objectPath,
@@ -59,51 +141,142 @@ void Actions::load()
     QDBusPendingCallWatcher *watcher = new QDBusPendingCallWatcher(reply, this);
     connect(watcher, &QDBusPendingCallWatcher::finished, this, [this](QDBusPendingCallWatcher *watcher) {
         QDBusPendingReply<GMenuActionMap> reply = *watcher;
+        m_loading = false;
         if (reply.isError()) {
             qDebug() << "Failed to get actions from" << m_serviceName << "at" << m_objectPath << reply.error();
             emit failedToLoad();
         } else {
-            m_actions = reply.value();
+            const GMenuActionMap actions = reply.value();
+            m_actions.clear();
+            m_actions.reserve(actions.count());
+            for (auto it = actions.constBegin(), end = actions.constEnd(); it != end; ++it) {
+                insert(it.key(), it.value());
+            }
+            m_loaded = true;
             emit loaded();
         }
         watcher->deleteLater();
     });
 }
 
-bool Actions::get(const QString &name, GMenuAction &action) const
+bool Actions::isLoaded() const
+{
+    return m_loaded;
+}
+
+bool Actions::isLazy() const
+{
+    return m_lazy;
+}
+
+void Actions::describe(const QVector<uint> &actions)
+{
+    if (!m_lazy) {
+        return;
+    }
+
+    const bool scheduled = !m_toDescribe.isEmpty();
+
+    for (uint action : actions) {
+        if (m_available.contains(action) && !m_actions.contains(action) && !m_describing.contains(action)) {
+            m_describing.insert(action);
+            m_toDescribe.append(action);
+        }
+    }
+
+    if (!scheduled && !m_toDescribe.isEmpty()) {
+        QTimer::singleShot(0, this, &Actions::describeQueued);
+    }
+}
+
+void Actions::describeQueued()
+{
+    const QVector<uint> batch = m_toDescribe;
+    m_toDescribe.clear();
+
+    if (batch.isEmpty()) {
+        return;
+    }
+
+    // there is no Describe for many actions, send all calls at once and signal once the last one is back
+    QSharedPointer<int> pending(new int(batch.count()));
+    QSharedPointer<QVector<uint>> described(new QVector<uint>);
+
+    for (uint action : batch) {
+        QDBusMessage msg = QDBusMessage::createMethodCall(m_serviceName,
+                                                        m_objectPath,
+                                                        s_orgGtkActions,
+                                                        QStringLiteral("Describe"));
+        msg << m_atoms->string(action);
+
+        QDBusPendingReply<GMenuAction> reply = QDBusConnection::sessionBus().asyncCall(msg);
+        QDBusPendingCallWatcher *watcher = new QDBusPendingCallWatcher(reply, this);
+        connect(watcher, &QDBusPendingCallWatcher::finished, this, [this, action, pending, described](QDBusPendingCallWatcher *watcher) {
+            QDBusPendingReply<GMenuAction> reply = *watcher;
+            watcher->deleteLater();
+
+            // unless it got removed in the meantime
+            if (m_describing.remove(action)) {
+                if (reply.isError()) {
+                    qDebug() << "Failed to describe action" << m_atoms->string(action) << "on" << m_serviceName << "at" << m_objectPath << reply.error();
+
+                    // its items stay disabled until we have it, try again with the next batch, but not forever
+                    static const int s_maxDescribeAttempts = 3;
+                    if (++m_describeFailures[action] < s_maxDescribeAttempts) {
+                        describe({action});
+                    } else {
+                        m_describeFailures.remove(action);
+                    }
+                } else {
+                    m_describeFailures.remove(action);
+                    m_actions.insert(action, reply.value());
+                    described->append(action);
+                }
+            }
+
+            if (--*pending == 0 && !described->isEmpty()) {
+                emit actionsChanged(*described);
+            }
+        });
+    }
+}
+
+bool Actions::has(uint action) const
+{
+    return m_actions.contains(action) || m_available.contains(action);
+}
+
+const GMenuAction *Actions::get(uint action) const
 {
-    auto it = m_actions.find(name);
+    auto it = m_actions.constFind(action);
     if (it == m_actions.constEnd()) {
-        return false;
+        return nullptr;
     }
 
-    action = *it;
-    return true;
+    return &*it;
 }
 
-GMenuActionMap Actions::getAll() const
+QVector<uint> Actions::all() const
 {
-    return m_actions;
+    return m_actions.keys().toVector();
 }
 
-void Actions::trigger(const QString &name, const QVariant &target, uint timestamp)
+void Actions::insert(const QString &name, const GMenuAction &action)
 {
-    if (!m_actions.contains(name)) {
-        qDebug() << "Cannot invoke action" << name << "which doesn't exist";
-        return;
+    m_actions.insert(m_atoms->atom(name), action);
+}
+
+bool Actions::trigger(uint action, const QVariant &target, uint timestamp)
+{
+    if (!has(action)) {
+        return failTrigger(action, "which doesn't exist");
     }
 
-    QDBusMessage msg = QDBusMessage::createMethodCall(m_serviceName,
-                                                    m_objectPath,
-                                                    s_orgGtkActions,
-                                                    QStringLiteral("Activate"));
-    msg << name;
+    QDBusMessage msg = m_activateTemplate;
 
     QVariantList args;
     if (target.isValid()) args << target;
 
-    msg << QVariant::fromValue(args);
-
     QVariantMap platformData;
 
     if (timestamp) {
@@ -114,22 +287,29 @@ void Actions::trigger(const QString &name, const QVariant &target, uint timestam
         platformData.insert(QStringLiteral("desktop-startup-id"), QStringLiteral("_TIME") + QString::number(timestamp));
     }
 
-    msg << platformData;
+    msg.setArguments({m_atoms->string(action), QVariant::fromValue(args), platformData});
 
-    QDBusPendingReply<void> reply = QDBusConnection::sessionBus().asyncCall(msg);
-    QDBusPendingCallWatcher *watcher = new QDBusPendingCallWatcher(reply, this);
-    connect(watcher, &QDBusPendingCallWatcher::finished, this, [this, name](QDBusPendingCallWatcher *watcher) {
-        QDBusPendingReply<void> reply = *watcher;
-        if (reply.isError()) {
-            qDebug() << "Failed to invoke action" << name << "on" << m_serviceName << "at" << m_objectPath << reply.error();
-        }
-        watcher->deleteLater();
+    // Activate returns nothing, send() marks the call as not expecting a reply so nobody has to wait for one
+    if (!QDBusConnection::sessionBus().send(msg)) {
+        return failTrigger(action, "because it could not be sent");
+    }
+
+    return true;
+}
+
+bool Actions::failTrigger(uint action, const char *reason)
+{
+    // don't hold up the click with logging, just let whoever cares know later
+    QTimer::singleShot(0, this, [this, action, reason] {
+        qDebug() << "Cannot invoke action" << m_atoms->string(action) << reason << "on" << m_serviceName << "at" << m_objectPath;
+        emit triggerFailed(action);
     });
+    return false;
 }
 
 bool Actions::isValid() const
 {
-    return !m_actions.isEmpty();
+    return !m_actions.isEmpty() || !m_available.isEmpty();
 }
 
 void Actions::onActionsChanged(const QStringList &removed,
@@ -138,28 +318,39 @@ void Actions::onActionsChanged(const QStringList &removed,
                             const GMenuActionMap &added)
 {
     // Collect the actions that we removed, altered, or added, so we can eventually signal changes for all menus that contain one of those actions
-    QStringList dirtyActions;
+    QVector<uint> dirtyActions;
 
     // TODO I bet for most of the loops below we could use a nice short std algorithm
 
-    for (const QString &removedAction : removed)
-        if (m_actions.remove(removedAction))
-            dirtyActions.append(removedAction);
+    for (const QString &removedAction : removed) {
+        // never heard of, so nothing of ours references it either
+        const uint atom = m_atoms->find(removedAction);
+        if (!atom)
+            continue;
+        m_available.remove(atom);
+        m_describing.remove(atom);
+        m_describeFailures.remove(atom);
+        if (m_actions.remove(atom))
+            dirtyActions.append(atom);
+    }
 
     for (auto it = enabledChanges.constBegin(), end = enabledChanges.constEnd(); it != end; ++it) {
         const QString &actionName = it.key();
         const bool enabled = it.value();
 
-        auto actionIt = m_actions.find(actionName);
+        const uint atom = m_atoms->find(actionName);
+        auto actionIt = m_actions.find(atom);
         if (actionIt == m_actions.end()) {
-            qDebug() << "Got enabled changed for action" << actionName << "which we don't know";
+            // not described yet, it will be up to date when it is
+            if (!m_available.contains(atom))
+                qDebug() << "Got enabled changed for action" << actionName << "which we don't know";
             continue;
         }
 
         GMenuAction &action = *actionIt;
         if (action.enabled != enabled) {
             action.enabled = enabled;
-            dirtyActions.append(actionName);
+            dirtyActions.append(actionIt.key());
         } else {
             qDebug() << "Got enabled change for action" << actionName << "which didn't change it";
         }
@@ -169,9 +360,11 @@ void Actions::onActionsChanged(const QStringList &removed,
         const QString &actionName = it.key();
         const QVariant &state = it.value();
 
-        auto actionIt = m_actions.find(actionName);
+        const uint atom = m_atoms->find(actionName);
+        auto actionIt = m_actions.find(atom);
         if (actionIt == m_actions.end()) {
-            qDebug() << "Got state changed for action" << actionName << "which we don't know";
+            if (!m_available.contains(atom))
+                qDebug() << "Got state changed for action" << actionName << "which we don't know";
             continue;
         }
 
@@ -180,13 +373,13 @@ void Actions::onActionsChanged(const QStringList &removed,
         if (action.state.isEmpty()) {
             qDebug() << "Got new state for action" << actionName << "that didn't have any state before";
             action.state.append(state);
-            dirtyActions.append(actionName);
+            dirtyActions.append(actionIt.key());
         } else {
             // Action state is a list but the state change only sends us a single variant, so just overwrite the first one
             QVariant &firstState = action.state.first();
             if (firstState != state) {
                 firstState = state;
-                dirtyActions.append(actionName);
+                dirtyActions.append(actionIt.key());
             } else {
                 qDebug() << "Got state change for action" << actionName << "which didn't change it";
             }
@@ -203,9 +396,15 @@ void Actions::onActionsChanged(const QStringList &removed,
 //            }
 //        }
 
-        m_actions.insert(actionName, it.value());
+        insert(actionName, it.value());
 
-        dirtyActions.append(actionName);
+        const uint atom = m_atoms->atom(actionName);
+        // we got its description anyway, no need to ask for it
+        if (m_lazy) {
+            m_available.insert(atom);
+            m_describing.remove(atom);
+        }
+        dirtyActions.append(atom);
     }
 
     if (!dirtyActions.isEmpty())
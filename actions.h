@@ -19,13 +19,25 @@
 
 #pragma once
 
+#include <QDBusMessage>
+#include <QHash>
 #include <QObject>
+#include <QSet>
+#include <QSharedPointer>
 #include <QString>
+#include <QVector>
 
 #include "gdbusmenutypes_p.h"
 
 class QStringList;
 
+class SignalDispatcher;
+
+namespace Utils
+{
+class AtomTable;
+}
+
 class Actions : public QObject
 {
     Q_OBJECT
@@ -34,18 +46,33 @@ public:
     Actions(const QString &serviceName, const QString &objectPath, QObject *parent = nullptr);
     ~Actions() override;
 
+    // the one instance for the actions at objectPath of the service, as long as anybody holds on to it
+    static QSharedPointer<Actions> shared(const QString &serviceName, const QString &objectPath);
+
     void load();
+    bool isLoaded() const;
+
+    // Applications with a lot of actions are loaded lazily: we only List them, and describe() the
+    // ones their menus show. Until an action is described get() doesn't have it.
+    bool isLazy() const;
+    // asks for the actions we don't have yet, in one batch per event loop run; actionsChanged() tells when they're in
+    void describe(const QVector<uint> &actions);
 
-    bool get(const QString &name, GMenuAction &action) const;
-    GMenuActionMap getAll() const;
-    void trigger(const QString &name, const QVariant &target, uint timestamp = 0);
+    // actions are looked up by the atom of their name in the Utils::AtomTable of the app
+    // nullptr if we don't have it, valid until the actions change
+    const GMenuAction *get(uint action) const;
+    QVector<uint> all() const;
+    // fire and forget, the application doesn't answer; false if it could not even be sent,
+    // triggerFailed() is emitted for that from the event loop
+    bool trigger(uint action, const QVariant &target, uint timestamp = 0);
 
     bool isValid() const; // basically "has actions"
 
 signals:
     void loaded();
     void failedToLoad(); // expose error?
-    void actionsChanged(const QStringList &dirtyActions);
+    void actionsChanged(const QVector<uint> &dirtyActions);
+    void triggerFailed(uint action);
 
 private slots:
     void onActionsChanged(const QStringList &removed,
@@ -54,9 +81,32 @@ private slots:
                         const GMenuActionMap &added);
 
 private:
-    GMenuActionMap m_actions;
+    void insert(const QString &name, const GMenuAction &action);
+    void loadAll();
+    void describeQueued();
+    bool has(uint action) const;
+    bool failTrigger(uint action, const char *reason);
+
+    // keyed by the atom of the name, as referenced by GMenuEntry::actionAtom
+    QHash<uint, GMenuAction> m_actions;
+    bool m_loading = false;
+    bool m_loaded = false;
+
+    bool m_lazy = false;
+    QSet<uint> m_available; // everything the application has, in lazy mode
+    QSet<uint> m_describing; // asked for, no answer yet
+    QVector<uint> m_toDescribe; // waiting for the next batch
+    QHash<uint, int> m_describeFailures; // failed Describe calls per action, retried a few times
 
     QString m_serviceName;
     QString m_objectPath;
 
+    // Activate call with everything but the arguments filled in
+    QDBusMessage m_activateTemplate;
+
+    // shared with the Menus of the app, so GMenuEntry::actionAtom is what we key m_actions by
+    QSharedPointer<Utils::AtomTable> m_atoms;
+
+    QSharedPointer<SignalDispatcher> m_signalDispatcher;
+
 };
@@ -26,6 +26,7 @@
 // Qt
 #include <QDBusArgument>
 #include <QDBusMetaType>
+#include <QMetaType>
 
 //// DBusMenuItem
 QDBusArgument &operator<<(QDBusArgument &argument, const DBusMenuItem &obj)
@@ -94,6 +95,23 @@ const QDBusArgument &operator>>(const QDBusArgument &argument, DBusMenuLayoutIte
     return argument;
 }
 
+//// DBusMenuEvent
+QDBusArgument &operator<<(QDBusArgument &argument, const DBusMenuEvent &obj)
+{
+    argument.beginStructure();
+    argument << obj.id << obj.eventId << obj.data << obj.timestamp;
+    argument.endStructure();
+    return argument;
+}
+
+const QDBusArgument &operator>>(const QDBusArgument &argument, DBusMenuEvent &obj)
+{
+    argument.beginStructure();
+    argument >> obj.id >> obj.eventId >> obj.data >> obj.timestamp;
+    argument.endStructure();
+    return argument;
+}
+
 //// DBusMenuShortcut
 QDBusArgument &operator<<(QDBusArgument &argument, const DBusMenuShortcut &obj)
 {
@@ -131,6 +149,10 @@ void DBusMenuTypes_register()
     qDBusRegisterMetaType<DBusMenuItemKeysList>();
     qDBusRegisterMetaType<DBusMenuLayoutItem>();
     qDBusRegisterMetaType<DBusMenuLayoutItemList>();
+    qDBusRegisterMetaType<DBusMenuEvent>();
+    qDBusRegisterMetaType<DBusMenuEventList>();
     qDBusRegisterMetaType<DBusMenuShortcut>();
+    // so QVariant can tell whether a shortcut actually changed
+    QMetaType::registerEqualsComparator<DBusMenuShortcut>();
     registered = true;
 }
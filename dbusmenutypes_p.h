@@ -22,6 +22,7 @@
 #define DBUSMENUTYPES_P_H
 
 // Qt
+#include <QDBusVariant>
 #include <QList>
 #include <QStringList>
 #include <QVariant>
@@ -89,6 +90,27 @@ typedef QList<DBusMenuLayoutItem> DBusMenuLayoutItemList;
 
 Q_DECLARE_METATYPE(DBusMenuLayoutItemList)
 
+//// DBusMenuEvent
+/**
+ * Represents one event of an EventGroup() call
+ */
+struct DBusMenuEvent
+{
+    int id;
+    QString eventId;
+    QDBusVariant data;
+    uint timestamp;
+};
+
+Q_DECLARE_METATYPE(DBusMenuEvent)
+
+QDBusArgument &operator<<(QDBusArgument &argument, const DBusMenuEvent &);
+const QDBusArgument &operator>>(const QDBusArgument &argument, DBusMenuEvent &);
+
+typedef QList<DBusMenuEvent> DBusMenuEventList;
+
+Q_DECLARE_METATYPE(DBusMenuEventList)
+
 //// DBusMenuShortcut
 
 class DBusMenuShortcut;
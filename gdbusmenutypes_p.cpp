@@ -21,12 +21,38 @@
 
 #include <QDBusArgument>
 #include <QDBusMetaType>
+#include <QDBusVariant>
+
+#include "utils.h"
+
+// Reads an a(...) of items in place, without going through a QVariantMap per item
+static void readEntries(const QDBusArgument &argument, GMenuEntryList &items)
+{
+    items.clear();
+    argument.beginArray();
+    while (!argument.atEnd()) {
+        GMenuEntry entry;
+        argument >> entry;
+        items.append(entry);
+    }
+    argument.endArray();
+}
+
+static void writeEntries(QDBusArgument &argument, const GMenuEntryList &items)
+{
+    argument.beginArray(qMetaTypeId<GMenuEntry>());
+    for (const GMenuEntry &entry : items) {
+        argument << entry;
+    }
+    argument.endArray();
+}
 
 // GMenuItem
 QDBusArgument &operator<<(QDBusArgument &argument, const GMenuItem &item)
 {
     argument.beginStructure();
-    argument << item.id << item.section << item.items;
+    argument << item.id << item.section;
+    writeEntries(argument, item.items);
     argument.endStructure();
     return argument;
 }
@@ -34,7 +60,8 @@ QDBusArgument &operator<<(QDBusArgument &argument, const GMenuItem &item)
 const QDBusArgument &operator>>(const QDBusArgument &argument, GMenuItem &item)
 {
     argument.beginStructure();
-    argument >> item.id >> item.section >> item.items;
+    argument >> item.id >> item.section;
+    readEntries(argument, item.items);
     argument.endStructure();
     return argument;
 }
@@ -56,11 +83,134 @@ const QDBusArgument &operator>>(const QDBusArgument &argument, GMenuSection &ite
     return argument;
 }
 
+// GMenuEntry
+QDBusArgument &operator<<(QDBusArgument &argument, const GMenuEntry &item)
+{
+    QVariantMap map;
+
+    if (!item.label.isEmpty())
+        map.insert(QStringLiteral("label"), item.label);
+    if (!item.action.isEmpty())
+        map.insert(item.isSubmenu() ? QStringLiteral("submenu-action") : QStringLiteral("action"), item.action);
+    if (item.target.isValid())
+        map.insert(QStringLiteral("target"), item.target);
+    if (!item.accel.isEmpty())
+        map.insert(QStringLiteral("accel"), item.accel);
+    if (!item.icon.isEmpty())
+        map.insert(QStringLiteral("icon"), item.icon);
+
+    if (item.isSection())
+        map.insert(QStringLiteral(":section"), QVariant::fromValue(item.link));
+    else if (item.isSubmenu())
+        map.insert(QStringLiteral(":submenu"), QVariant::fromValue(item.link));
+
+    if (item.flags & GMenuEntry::HiddenWhenActionMissing)
+        map.insert(QStringLiteral("hidden-when"), QStringLiteral("action-missing"));
+    else if (item.flags & GMenuEntry::HiddenWhenActionDisabled)
+        map.insert(QStringLiteral("hidden-when"), QStringLiteral("action-disabled"));
+
+    argument << map;
+    return argument;
+}
+
+static const struct {
+    QLatin1String prefix;
+    GMenuEntry::ActionScope scope;
+} s_actionScopes[] = {
+    {QLatin1String("app."), GMenuEntry::ApplicationActions},
+    {QLatin1String("unity."), GMenuEntry::UnityActions},
+    {QLatin1String("win."), GMenuEntry::WindowActions},
+};
+
+// Finds the group the action is in once, rather than on every lookup
+static void resolveActionScope(GMenuEntry &item)
+{
+    for (const auto &scope : s_actionScopes) {
+        if (item.action.startsWith(scope.prefix)) {
+            item.actionScope = scope.scope;
+            return;
+        }
+    }
+}
+
+QString GMenuEntry::actionName() const
+{
+    for (const auto &scope : s_actionScopes) {
+        if (scope.scope == actionScope)
+            return action.mid(scope.prefix.size());
+    }
+    return QString();
+}
+
+const QDBusArgument &operator>>(const QDBusArgument &argument, GMenuEntry &item)
+{
+    item = GMenuEntry();
+
+    QString submenuAction;
+    QString verbIcon;
+
+    argument.beginMap();
+    while (!argument.atEnd()) {
+        QString key;
+        QDBusVariant value;
+        argument.beginMapEntry();
+        argument >> key >> value;
+        argument.endMapEntry();
+
+        const QVariant variant = value.variant();
+
+        if (key == QLatin1String("label")) {
+            // not interned, some change all the time ("Undo: Typing 'x'") and would just pile up
+            item.label = variant.toString();
+        } else if (key == QLatin1String("action")) {
+            item.action = Utils::intern(variant.toString());
+        } else if (key == QLatin1String("submenu-action")) {
+            submenuAction = variant.toString();
+        } else if (key == QLatin1String("target")) {
+            item.target = variant;
+        } else if (key == QLatin1String("accel")) {
+            item.accel = Utils::intern(variant.toString());
+        } else if (key == QLatin1String("icon")) {
+            item.icon = Utils::intern(variant.toString());
+        } else if (key == QLatin1String("verb-icon")) {
+            verbIcon = variant.toString();
+        } else if (key == QLatin1String(":section")) {
+            // a section wins over a submenu, not that anyone sends both
+            item.link = qdbus_cast<GMenuSection>(variant.value<QDBusArgument>());
+            item.flags = (item.flags & ~GMenuEntry::HasSubmenu) | GMenuEntry::HasSection;
+        } else if (key == QLatin1String(":submenu")) {
+            if (!item.isSection()) {
+                item.link = qdbus_cast<GMenuSection>(variant.value<QDBusArgument>());
+                item.flags |= GMenuEntry::HasSubmenu;
+            }
+        } else if (key == QLatin1String("hidden-when")) {
+            // While we have Global Menu we don't have macOS menu (where Quit, Help, etc is separate)
+            // so "macos-menubar" means always visible for us
+            const QString hiddenWhen = variant.toString();
+            if (hiddenWhen == QLatin1String("action-missing"))
+                item.flags |= GMenuEntry::HiddenWhenActionMissing;
+            else if (hiddenWhen == QLatin1String("action-disabled"))
+                item.flags |= GMenuEntry::HiddenWhenActionDisabled;
+        }
+    }
+    argument.endMap();
+
+    if (item.action.isEmpty())
+        item.action = Utils::intern(submenuAction);
+    if (item.icon.isEmpty())
+        item.icon = Utils::intern(verbIcon);
+
+    resolveActionScope(item);
+
+    return argument;
+}
+
 // GMenuChange
 QDBusArgument &operator<<(QDBusArgument &argument, const GMenuChange &item)
 {
     argument.beginStructure();
-    argument << item.subscription << item.section << item.changePosition << item.itemsToRemoveCount << item.itemsToInsert;
+    argument << item.subscription << item.section << item.changePosition << item.itemsToRemoveCount;
+    writeEntries(argument, item.itemsToInsert);
     argument.endStructure();
     return argument;
 }
@@ -68,7 +218,8 @@ QDBusArgument &operator<<(QDBusArgument &argument, const GMenuChange &item)
 const QDBusArgument &operator>>(const QDBusArgument &argument, GMenuChange &item)
 {
     argument.beginStructure();
-    argument >> item.subscription >> item.section >> item.changePosition >> item.itemsToRemoveCount >> item.itemsToInsert;
+    argument >> item.subscription >> item.section >> item.changePosition >> item.itemsToRemoveCount;
+    readEntries(argument, item.itemsToInsert);
     argument.endStructure();
     return argument;
 }
@@ -118,6 +269,7 @@ void GDBusMenuTypes_register()
     qDBusRegisterMetaType<GMenuItemList>();
 
     qDBusRegisterMetaType<GMenuSection>();
+    qDBusRegisterMetaType<GMenuEntry>();
 
     qDBusRegisterMetaType<GMenuChange>();
     qDBusRegisterMetaType<GMenuChangeList>();
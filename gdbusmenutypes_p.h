@@ -23,6 +23,7 @@
 #include <QList>
 #include <QMap>
 #include <QVariant>
+#include <QVector>
 
 class QDBusArgument;
 
@@ -33,15 +34,72 @@ Q_DECLARE_METATYPE(VariantMapList);
 using StringBoolMap = QMap<QString, bool>;
 Q_DECLARE_METATYPE(StringBoolMap);
 
+// Information about what section or submenu to use for a particular entry
+struct GMenuSection
+{
+    uint subscription;
+    uint section;
+
+    GMenuSection() : GMenuSection(0, 0) {}
+
+    GMenuSection(uint sub, uint sec) : subscription(sub), section(sec) {}
+};
+Q_DECLARE_METATYPE(GMenuSection);
+
+QDBusArgument &operator<<(QDBusArgument &argument, const GMenuSection &item);
+const QDBusArgument &operator>>(const QDBusArgument &argument, GMenuSection &item);
+
+// A menu item as we keep it, read straight from its a{sv} when it comes in
+struct GMenuEntry
+{
+    enum Flag : quint8 {
+        HasSection = 1 << 0, // link is a ":section"
+        HasSubmenu = 1 << 1, // link is a ":submenu"
+        HiddenWhenActionMissing = 1 << 2,
+        HiddenWhenActionDisabled = 1 << 3,
+    };
+
+    // which of the window's action groups the action is in, from its "app.", "unity." or "win." prefix
+    enum ActionScope : quint8 {
+        NoActionScope = 0, // no action or one we wouldn't know where to find
+        ApplicationActions,
+        UnityActions,
+        WindowActions,
+    };
+
+    QString label;
+    QString action; // "action", or "submenu-action" if there is none
+    QVariant target;
+    QString accel;
+    QString icon; // "icon", or "verb-icon" if there is none
+    GMenuSection link;
+    quint8 flags = 0;
+    quint8 actionScope = NoActionScope;
+    uint actionAtom = 0; // atom of actionName() in the AtomTable of the app, given out by Menu, what Actions knows it by
+    int id = 0; // DBusMenu id given out by Menu, 0 until it has one
+
+    bool isSection() const { return flags & HasSection; }
+    bool isSubmenu() const { return flags & HasSubmenu; }
+    // the action name without its scope prefix, empty without a scope
+    QString actionName() const;
+};
+Q_DECLARE_TYPEINFO(GMenuEntry, Q_MOVABLE_TYPE);
+Q_DECLARE_METATYPE(GMenuEntry);
+
+QDBusArgument &operator<<(QDBusArgument &argument, const GMenuEntry &item);
+const QDBusArgument &operator>>(const QDBusArgument &argument, GMenuEntry &item);
+
+using GMenuEntryList = QVector<GMenuEntry>;
+
 // Menu item itself (Start method)
 struct GMenuItem
 {
     uint id;
     uint section;
-    VariantMapList items;
+    GMenuEntryList items;
 
     GMenuItem(){}
-    GMenuItem(uint id, uint section, VariantMapList items) : id(id), section(section), items(items) {}
+    GMenuItem(uint id, uint section, GMenuEntryList items) : id(id), section(section), items(items) {}
 };
 Q_DECLARE_METATYPE(GMenuItem);
 
@@ -51,21 +109,6 @@ const QDBusArgument &operator>>(const QDBusArgument &argument, GMenuItem &item);
 using GMenuItemList = QList<GMenuItem>;
 Q_DECLARE_METATYPE(GMenuItemList);
 
-// Information about what section or submenu to use for a particular entry
-struct GMenuSection
-{
-    uint subscription;
-    uint section;
-
-    GMenuSection() : GMenuSection(0, 0) {}
-
-    GMenuSection(uint sub, uint sec) : subscription(sub), section(sec) {}
-};
-Q_DECLARE_METATYPE(GMenuSection);
-
-QDBusArgument &operator<<(QDBusArgument &argument, const GMenuSection &item);
-const QDBusArgument &operator>>(const QDBusArgument &argument, GMenuSection &item);
-
 // Changes of a menu item (Changed signal)
 struct GMenuChange
 {
@@ -74,7 +117,7 @@ struct GMenuChange
 
     uint changePosition;
     uint itemsToRemoveCount;
-    VariantMapList itemsToInsert;
+    GMenuEntryList itemsToInsert;
 };
 Q_DECLARE_METATYPE(GMenuChange);
 
@@ -19,15 +19,21 @@
 
 #include "menu.h"
 
+#include <QDBusArgument>
 #include <QDBusConnection>
 #include <QDBusMessage>
 #include <QDBusPendingCallWatcher>
 #include <QDBusPendingReply>
 #include <QDebug>
+#include <QHash>
+#include <QPair>
 #include <QVariantList>
-#include <QTimer>
 #include <algorithm>
+#include <iterator>
 
+#include "actions.h"
+#include "menucache.h"
+#include "signaldispatcher.h"
 #include "utils.h"
 
 static const QString s_orgGtkMenus = QStringLiteral("org.gtk.Menus");
@@ -41,17 +47,106 @@ Menu::Menu(const QString &serviceName, const QString &objectPath, bool menubar,
     Q_ASSERT(!serviceName.isEmpty());
     Q_ASSERT(!m_objectPath.isEmpty());
 
-    if (!QDBusConnection::sessionBus().connect(m_serviceName,
-                                            m_objectPath,
-                                            s_orgGtkMenus,
-                                            QStringLiteral("Changed"),
-                                            this,
-                                            SLOT(onMenuChanged(GMenuChangeList)))) {
-        qDebug() << "Failed to subscribe to menu changes for" << parent << "on" << serviceName << "at" << objectPath;
+    m_atoms = Utils::AtomTable::forService(m_serviceName);
+
+    m_signalDispatcher = SignalDispatcher::forService(m_serviceName);
+    m_signalDispatcher->addHandler(this, m_objectPath, s_orgGtkMenus, [this](const QDBusMessage &message) {
+        onMenuChanged(qdbus_cast<GMenuChangeList>(message.arguments().value(0)));
+    });
+}
+
+Menu::~Menu()
+{
+    m_signalDispatcher->removeHandlers(this);
+
+    MenuCache::self()->remove(this);
+}
+
+QSharedPointer<Menu> Menu::shared(const QString &serviceName, const QString &objectPath, bool menubar)
+{
+    static QHash<QPair<QString, QString>, QWeakPointer<Menu>> s_menus;
+
+    return Utils::sharedInstance(s_menus, qMakePair(serviceName, objectPath), [&] {
+        return new Menu(serviceName, objectPath, menubar);
+    });
+}
+
+void Menu::prefetch(int depth)
+{
+    QHash<uint, int> missing;
+    QSet<uint> visited;
+    collectPrefetch(0, 0, depth, missing, visited);
+
+    if (missing.isEmpty())
+        return;
+
+    qDebug() << "Prefetching" << missing.keys() << "on" << m_serviceName << "at" << m_objectPath;
+
+    QSet<uint> ids;
+    for (auto it = missing.constBegin(), end = missing.constEnd(); it != end; ++it) {
+        m_prefetching.insert(it.key(), it.value());
+        ids.insert(it.key());
+    }
+
+    start(ids);
+}
+
+void Menu::collectPrefetch(uint subscription, uint section, int depth, QHash<uint, int> &missing, QSet<uint> &visited) const
+{
+    const uint key = Utils::treeStructureToInt(subscription, section, 0);
+    if (depth <= 0 || visited.contains(key))
+        return;
+    visited.insert(key);
+
+    const MenuSection *menu = getSection(subscription, section);
+    if (!menu)
+        return;
+
+    for (const auto &item : menu->items) {
+        if (item.isSection()) {
+            // sections are on the same level as the items next to them
+            const ResolvedSection resolved = resolveSection(item.link.subscription, item.link.section);
+            collectPrefetch(resolved.subscription, resolved.section, depth, missing, visited);
+            continue;
+        }
+
+        if (!item.isSubmenu())
+            continue;
+
+        // the "菜单" wrapper of an application menu is ours, what it opens is the actual top level
+        const int submenuDepth = !menubar && subscription == 0 ? depth : depth - 1;
+
+        const GMenuSection &submenu = item.link;
+        if (hasSubscription(submenu.subscription)) {
+            collectPrefetch(submenu.subscription, submenu.section, submenuDepth, missing, visited);
+        } else if (!m_testings.contains(submenu.subscription)) {
+            missing[submenu.subscription] = std::max(missing.value(submenu.subscription), submenuDepth);
+        }
     }
 }
 
-Menu::~Menu() = default;
+void Menu::onPrefetched(uint id)
+{
+    const int depth = m_prefetching.take(id);
+    if (depth <= 0)
+        return;
+
+    // continue below whatever we got
+    QHash<uint, int> missing;
+    QSet<uint> visited;
+    const MenuSectionHash menus = m_menus.value(id);
+    for (const MenuSection &menu : menus)
+        collectPrefetch(menu.subscription, menu.section, depth, missing, visited);
+
+    QSet<uint> ids;
+    for (auto it = missing.constBegin(), end = missing.constEnd(); it != end; ++it) {
+        m_prefetching.insert(it.key(), it.value());
+        ids.insert(it.key());
+    }
+
+    if (!ids.isEmpty())
+        start(ids);
+}
 
 void Menu::cleanup()
 {
@@ -60,29 +155,42 @@ void Menu::cleanup()
 
 void Menu::start(uint id)
 {
-    if (m_subscriptions.contains(id) || m_testings.contains(id))
-        return;
+    start(QSet<uint>{id});
+}
 
-    m_testings.insert(id);
+void Menu::start(const QSet<uint> &ids)
+{
+    // ask for all of them in one go, org.gtk.Menus.Start takes a list of groups
+    QList<uint> groups;
 
-    if(!menubar && id == 0) {
-        QTimer::singleShot(20, [this, id]{
-            if (!m_menus.contains(id)) {
-                m_testings.remove(id);
+    for (uint id : ids) {
+        if (m_subscriptions.contains(id) || m_testings.contains(id))
+            continue;
 
-                m_menus[id].append(GMenuItem(0, 0, VariantMapList{QVariantMap{{":section", QVariant::fromValue(GMenuSection(0, 1))}}}));
-                m_menus[id].append(GMenuItem(0, 1, VariantMapList{QVariantMap{{":submenu", QVariant::fromValue(GMenuSection(START_INDEX, 0))}, {"label", "菜单"}}}));
+        m_testings.insert(id);
 
-                m_subscriptions.insert(id);
-                emit menuAppeared();
+        if(!menubar && id == 0) {
+            // the "菜单" wrapper is ours, all it needs is the application menu it wraps,
+            // it is put in place once that arrives
+            if (m_subscriptions.contains(START_INDEX)) {
+                m_testings.remove(id);
+                addSyntheticRoot();
+                emit subscribed(id);
+            } else if (!m_testings.contains(START_INDEX)) {
+                m_testings.insert(START_INDEX);
+                groups.append(0);
             }
+            continue;
+        }
 
-            emit subscribed(id);
-        });
-        return;
+        // the application menu itself is group 0 of the app but lives at START_INDEX for us
+        groups.append(!menubar && id == START_INDEX ? 0 : id);
     }
 
-    // TODO watch service disappearing?
+    if (groups.isEmpty())
+        return;
+
+    // Window tears us down when the service disappears
 
     // dbus-send --print-reply --session --dest=:1.103 /org/libreoffice/window/104857641/menus/menubar org.gtk.Menus.Start array:uint32:0
 
@@ -91,71 +199,147 @@ void Menu::start(uint id)
                                                     s_orgGtkMenus,
                                                     QStringLiteral("Start"));
     msg.setArguments({
-        QVariant::fromValue(QList<uint>{!menubar && id == START_INDEX ? 0 :id})
+        QVariant::fromValue(groups)
     });
 
     QDBusPendingReply<GMenuItemList> reply = QDBusConnection::sessionBus().asyncCall(msg);
     QDBusPendingCallWatcher *watcher = new QDBusPendingCallWatcher(reply, this);
-    connect(watcher, &QDBusPendingCallWatcher::finished, this, [this, id](QDBusPendingCallWatcher *watcher) {
+    connect(watcher, &QDBusPendingCallWatcher::finished, this, [this, groups](QDBusPendingCallWatcher *watcher) {
         QScopedPointer<QDBusPendingCallWatcher, QScopedPointerDeleteLater> watcherPtr(watcher);
 
+        QList<uint> ids;
+        for (uint group : groups) {
+            const uint id = !menubar && group == 0 ? START_INDEX : group;
+            m_testings.remove(id);
+            ids.append(id);
+        }
+
         QDBusPendingReply<GMenuItemList> reply = *watcherPtr;
-        m_testings.remove(id);
 
         if (reply.isError()) {
-            qDebug() << "Failed to start subscription to" << id << "on" << m_serviceName << "at" << m_objectPath << reply.error();
+            qDebug() << "Failed to start subscription to" << ids << "on" << m_serviceName << "at" << m_objectPath << reply.error();
 
-            emit failedToSubscribe(id);
-        } else {
-            const bool hadMenu = !m_menus.isEmpty();
+            if (!menubar && ids.contains(START_INDEX) && m_testings.remove(0))
+                ids.prepend(0);
 
-            auto menus = reply.value();
+            for (uint id : qAsConst(ids)) {
+                // so a later prefetch() can ask for it again
+                m_prefetching.remove(id);
+                emit failedToSubscribe(id);
+            }
+            return;
+        }
+
+        const bool hadMenu = !m_menus.isEmpty();
+
+        const auto menus = reply.value();
+
+        QHash<uint, MenuSectionHash> received;
+        for (const GMenuItem &menu : menus) {
+            MenuSection section;
+            section.subscription = !menubar && menu.id == 0 ? START_INDEX : menu.id;
+            section.section = menu.section;
+
+            section.items = menu.items;
+            for (GMenuEntry &item : section.items)
+                remapLink(item);
+
+            received[section.subscription].insert(section.section, section);
+        }
+
+        QList<uint> subscribedIds;
+        for (uint id : qAsConst(ids)) {
+            const auto groupMenus = received.value(id);
 
             // LibreOffice on startup fails to give us some menus right away, we'll also subscribe in onMenuChanged() if necessary
-            if (menus.isEmpty()) {
+            if (groupMenus.isEmpty()) {
                 qDebug() << "Got an empty menu for" << id << "on" << m_serviceName << "at" << m_objectPath;
-                return;
+                // don't leave anyone waiting for it
+                emit failedToSubscribe(id);
+                continue;
             }
 
-            for(auto it=menus.begin(); it!=menus.end(); it++) {
-                if(!menubar && id==START_INDEX && it->id==0)
-                    it->id = START_INDEX;
-
-                for(auto iter = it->items.begin(); iter != it->items.end(); iter++) {
-                    if(iter->contains(":section")) {
-                        GMenuSection section = qdbus_cast<GMenuSection>(iter->value(":section").value<QDBusArgument>());
-                        if(!menubar && id==START_INDEX && section.subscription==0) section.subscription = START_INDEX;
-                        iter->insert(":section", QVariant::fromValue(section));
-                    } else if(iter->contains(":submenu")) {
-                        GMenuSection section = qdbus_cast<GMenuSection>(iter->value(":submenu").value<QDBusArgument>());
-                        if(!menubar && id==START_INDEX && section.subscription==0) section.subscription = START_INDEX;
-                        iter->insert(":submenu", QVariant::fromValue(section));
-                    }
-                }
+            auto &menu = m_menus[id];
+            for (const MenuSection &section : groupMenus) {
+                auto it = menu.find(section.section);
+                if (it != menu.end())
+                    unindexSection(*it);
+                indexSection(menu.insert(section.section, section).value());
             }
-
-            m_menus[id].append(menus);
-            // TODO are we subscribed to all it returns or just to the ones we requested?
             m_subscriptions.insert(id);
+            m_resolvedSections.clear();
+            subscribedIds.append(id);
+        }
 
-            // do we have a menu now? let's tell everyone
-            if (!hadMenu && !m_menus.isEmpty()) {
-                emit menuAppeared();
+        // now that there is an application menu, wrap it
+        if (!menubar && ids.contains(START_INDEX) && m_testings.remove(0)) {
+            if (subscribedIds.contains(START_INDEX)) {
+                addSyntheticRoot();
+                subscribedIds.prepend(0);
+            } else {
+                emit failedToSubscribe(0);
             }
+        }
 
+        // do we have a menu now? let's tell everyone
+        if (!hadMenu && !m_menus.isEmpty()) {
+            emit menuAppeared();
+        }
+
+        for (uint id : qAsConst(subscribedIds)) {
+            if (!isPinned(id))
+                MenuCache::self()->insert(this, id, itemCount(id));
+        }
+
+        // before anyone starts rendering the new items
+        flushRemovedItems();
+        flushActionReferences();
+
+        for (uint id : qAsConst(subscribedIds))
             emit subscribed(id);
+
+        for (uint id : qAsConst(ids)) {
+            if (m_prefetching.contains(id))
+                onPrefetched(id);
         }
     });
 }
 
+void Menu::addSyntheticRoot()
+{
+    if (m_menus.contains(0))
+        return;
+
+    GMenuEntry section;
+    section.link = GMenuSection(0, 1);
+    section.flags = GMenuEntry::HasSection;
+
+    GMenuEntry submenu;
+    submenu.label = QStringLiteral("菜单");
+    submenu.link = GMenuSection(START_INDEX, 0);
+    submenu.flags = GMenuEntry::HasSubmenu;
+
+    auto &menu = m_menus[0];
+    indexSection(menu.insert(0, MenuSection{0, 0, {section}}).value());
+    indexSection(menu.insert(1, MenuSection{0, 1, {submenu}}).value());
+
+    m_subscriptions.insert(0);
+    m_resolvedSections.clear();
+}
+
 void Menu::stop(const QSet<uint> &ids)
 {
     QDBusMessage msg = QDBusMessage::createMethodCall(m_serviceName,
                                                     m_objectPath,
                                                     s_orgGtkMenus,
                                                     QStringLiteral("End"));
+    // the application menu itself is group 0 of the app but lives at START_INDEX for us
+    QList<uint> groups;
+    for (uint id : ids)
+        groups.append(!menubar && id == START_INDEX ? 0 : id);
+
     msg.setArguments({
-        QVariant::fromValue(ids) // don't let it unwrap it, hence in a variant
+        QVariant::fromValue(groups) // don't let it unwrap it, hence in a variant
     });
 
     QDBusPendingReply<void> reply = QDBusConnection::sessionBus().asyncCall(msg);
@@ -164,6 +348,7 @@ void Menu::stop(const QSet<uint> &ids)
         QDBusPendingReply<void> reply = *watcher;
         if (reply.isError()) {
             qDebug() << "Failed to stop subscription to" << ids << "on" << m_serviceName << "at" << m_objectPath << reply.error();
+            MenuCache::self()->stopFailed(this, ids);
         } else {
             // remove all subscriptions that we unsubscribed from
             // TODO is there a nicer algorithm for that?
@@ -175,8 +360,16 @@ void Menu::stop(const QSet<uint> &ids)
             for(auto id : ids)
             {
                 m_subscriptions.remove(id);
-                m_menus.remove(id);
+                for (const MenuSection &section : m_menus.take(id))
+                    unindexSection(section);
+                MenuCache::self()->remove(this, id);
             }
+            m_resolvedSections.clear();
+
+            flushRemovedItems();
+
+            for (auto id : ids)
+                emit unsubscribed(id);
 
             if (m_subscriptions.isEmpty()) {
                 emit menuDisappeared();
@@ -196,62 +389,179 @@ bool Menu::hasSubscription(uint subscription) const
     return m_subscriptions.contains(subscription);
 }
 
-GMenuItem Menu::getSection(int id, bool *ok) const
+void Menu::markUsed(uint subscription)
 {
-    int subscription;
-    int section;
-    int index;
-    Utils::intToTreeStructure(id, subscription, section, index);
-    return getSection(subscription, section, ok);
+    MenuCache::self()->touch(this, subscription);
 }
 
-GMenuItem Menu::getSection(int subscription, int section, bool *ok) const
+bool Menu::isPinned(uint subscription) const
 {
-    const auto menu = m_menus.value(subscription);
+    return subscription == 0 || (!menubar && subscription == START_INDEX);
+}
 
-    auto it = std::find_if(menu.begin(), menu.end(), [section](const GMenuItem &item) {
-        return item.section == section;
-    });
+int Menu::itemCount(uint subscription) const
+{
+    int count = 0;
+    const MenuSectionHash menu = m_menus.value(subscription);
+    for (const MenuSection &section : menu)
+        count += section.items.count();
+    return count;
+}
 
-    if (it == menu.end()) {
-        if (ok) {
-            *ok = false;
+const MenuSection *Menu::getSection(int subscription, int section) const
+{
+    auto menuIt = m_menus.constFind(subscription);
+    if (menuIt == m_menus.constEnd()) {
+        return nullptr;
+    }
+
+    auto it = menuIt->constFind(section);
+    if (it == menuIt->constEnd()) {
+        return nullptr;
+    }
+
+    return &*it;
+}
+
+const GMenuEntry *Menu::getItem(int id) const
+{
+    auto it = m_items.constFind(id);
+    if (it == m_items.constEnd()) {
+        return nullptr;
+    }
+
+    const MenuSection *section = getSection(it->subscription, it->section);
+    if (!section || section->items.count() <= it->index) {
+        qDebug() << "Item" << id << "points to" << it->subscription << it->section << it->index << "which doesn't exist";
+        return nullptr;
+    }
+
+    return &section->items.at(it->index);
+}
+
+bool Menu::getItemSection(int id, uint &subscription, uint &section) const
+{
+    auto it = m_items.constFind(id);
+    if (it == m_items.constEnd()) {
+        return false;
+    }
+
+    subscription = it->subscription;
+    section = it->section;
+    return true;
+}
+
+static quint64 actionKey(quint8 scope, uint atom)
+{
+    return (quint64(scope) << 32) | atom;
+}
+
+void Menu::indexSection(MenuSection &section)
+{
+    for (int i = 0; i < section.items.count(); ++i) {
+        GMenuEntry &item = section.items[i];
+        if (item.id == 0)
+            item.id = m_nextItemId++;
+
+        m_items.insert(item.id, ItemLocation{section.subscription, section.section, i});
+        m_removedItems.remove(item.id);
+
+        if (item.actionScope != GMenuEntry::NoActionScope && !item.actionAtom)
+            item.actionAtom = m_atoms->atom(item.actionName());
+
+        if (item.actionAtom) {
+            QSet<uint> &items = m_actionItems[actionKey(item.actionScope, item.actionAtom)];
+            if (items.isEmpty())
+                m_newActionReferences = true;
+            items.insert(item.id);
         }
-        return GMenuItem();
     }
+}
 
-    if (ok) {
-        *ok = true;
+void Menu::unindexSection(const MenuSection &section)
+{
+    for (const GMenuEntry &item : section.items) {
+        if (m_items.remove(item.id))
+            m_removedItems.insert(item.id);
+
+        if (!item.actionAtom)
+            continue;
+
+        auto it = m_actionItems.find(actionKey(item.actionScope, item.actionAtom));
+        if (it != m_actionItems.end()) {
+            it->remove(item.id);
+            if (it->isEmpty())
+                m_actionItems.erase(it);
+        }
     }
-    return *it;
 }
 
-QVariantMap Menu::getItem(int id) const
+void Menu::flushRemovedItems()
 {
-    int subscription;
-    int section;
-    int index;
-    Utils::intToTreeStructure(id, subscription, section, index);
-    return getItem(subscription, section, index);
+    if (!m_removedItems.isEmpty()) {
+        const QSet<uint> removedItems = m_removedItems;
+        m_removedItems.clear();
+        emit itemsRemoved(removedItems);
+    }
 }
 
-QVariantMap Menu::getItem(int subscription, int sectionId, int index) const
+void Menu::flushActionReferences()
 {
-    bool ok;
-    const GMenuItem section = getSection(subscription, sectionId, &ok);
+    if (m_newActionReferences) {
+        m_newActionReferences = false;
+        emit actionsReferenced();
+    }
+}
 
-    if (!ok) {
-        return QVariantMap();
+QVector<uint> Menu::referencedActions(quint8 scope) const
+{
+    QVector<uint> actions;
+    for (auto it = m_actionItems.constBegin(), end = m_actionItems.constEnd(); it != end; ++it) {
+        if (quint8(it.key() >> 32) == scope)
+            actions.append(uint(it.key()));
     }
+    return actions;
+}
+
+void Menu::remapLink(GMenuEntry &item) const
+{
+    // the application menu itself is group 0 of the app but lives at START_INDEX for us
+    if (!menubar && (item.isSection() || item.isSubmenu()) && item.link.subscription == 0)
+        item.link.subscription = START_INDEX;
+}
+
+Menu::ResolvedSection Menu::resolveSection(uint subscription, uint section) const
+{
+    const uint key = Utils::treeStructureToInt(subscription, section, 0);
+
+    auto it = m_resolvedSections.constFind(key);
+    if (it != m_resolvedSections.constEnd())
+        return *it;
+
+    ResolvedSection resolved{subscription, section, {GMenuSection(subscription, section)}};
 
-    const auto items = section.items;
+    while (true) {
+        const MenuSection *menu = getSection(resolved.subscription, resolved.section);
+        if (!menu || menu->items.count() != 1 || !menu->items.constFirst().isSection())
+            break;
 
-    if (items.count() < index) {
-        qDebug() << "Cannot get action" << subscription << sectionId << index << "which is out of bounds";
-        return QVariantMap();
+        const GMenuSection alias = menu->items.constFirst().link;
+
+        const bool cyclic = std::any_of(resolved.path.constBegin(), resolved.path.constEnd(), [&alias](const GMenuSection &visited) {
+            return visited.subscription == alias.subscription && visited.section == alias.section;
+        });
+        if (cyclic) {
+            qDebug() << "Section" << subscription << section << "is a cyclic alias on" << m_serviceName << "at" << m_objectPath;
+            break;
+        }
+
+        resolved.subscription = alias.subscription;
+        resolved.section = alias.section;
+        resolved.path.append(alias);
     }
 
-    return items.at(index);
+    m_resolvedSections.insert(key, resolved);
+    return resolved;
 }
 
 void Menu::onMenuChanged(const GMenuChangeList &changes)
@@ -261,72 +571,56 @@ void Menu::onMenuChanged(const GMenuChangeList &changes)
     QSet<uint> dirtyMenus;
     QSet<uint> dirtyItems;
 
-    auto recurseRemove = [this](QVariantMap source) {
-        QSet<uint> ids;
-        std::function<void(QVariantMap)> reFind = [&ids, this, &reFind](QVariantMap source){
-            if(source.contains(QLatin1String(":submenu")))
-            {
-                GMenuSection gmenuSection = source.value(QLatin1String(":submenu")).value<GMenuSection>();
-                if(m_menus.contains(gmenuSection.subscription))
-                {
-                    for(auto item : m_menus.value(gmenuSection.subscription))
-                    {
-                        for(auto subSource : item.items)
-                            reFind(subSource);
-                    }
-                    ids.insert(gmenuSection.subscription);
-                }
-            }
-        };
-
-        reFind(source);
-
-        if(!ids.isEmpty())
-            stop(ids);
-    };
-
-    auto updateSection = [&dirtyItems, &dirtyMenus, this](const int subscription, const GMenuChange &change, GMenuItem &section) {
-        const bool reIndex = !menubar && subscription == START_INDEX;
-        const bool updateItem = change.itemsToRemoveCount == change.itemsToInsert.count();
+    auto updateSection = [&dirtyItems, &dirtyMenus, this](const int subscription, const GMenuChange &change, MenuSection &section) {
+        bool updateItem = change.itemsToRemoveCount == change.itemsToInsert.count();
         // Check if the amount of inserted items is identical to the items to be removed,
         // just update the existing items and signal a change for that.
         // LibreOffice tends to do that e.g. to update its Undo menu entry
 
-        for (int i = 0; i < change.itemsToRemoveCount; ++i) {
-            if(section.items.count() > change.changePosition)
-            {
-                QVariantMap source = section.items.takeAt(change.changePosition);
-                // recurseRemove(source);
-            } else
-                break;
-        }
+        const GMenuEntryList &oldItems = section.items;
+        // removing past the end removes nothing, inserting past the end appends
+        const int position = std::min<int>(change.changePosition, oldItems.count());
+        const int removeCount = std::min<int>(change.itemsToRemoveCount, oldItems.count() - position);
+
+        // splice it together in one go rather than shifting the rest around for every item
+        GMenuEntryList items;
+        items.reserve(oldItems.count() - removeCount + change.itemsToInsert.count());
+        std::copy(oldItems.constBegin(), oldItems.constBegin() + position, std::back_inserter(items));
 
         for (int i = 0; i < change.itemsToInsert.count(); ++i) {
-            QVariantMap map = change.itemsToInsert.at(i);
-            if(map.contains(":section")) {
-                GMenuSection sec = qdbus_cast<GMenuSection>(map.value(":section").value<QDBusArgument>());
-                if(reIndex && sec.subscription==0) sec.subscription = START_INDEX;
-                map[":section"].setValue(QVariant::fromValue(sec));
-            } else if(map.contains(":submenu")) {
-                GMenuSection sec = qdbus_cast<GMenuSection>(map.value(":submenu").value<QDBusArgument>());
-                if(reIndex && sec.subscription==0) sec.subscription = START_INDEX;
-                map[":submenu"].setValue(QVariant::fromValue(sec));
+            GMenuEntry map = change.itemsToInsert.at(i);
+            remapLink(map);
+
+            // the replacement keeps the id unless it now links somewhere else,
+            // then whoever shows it needs the new layout anyway
+            if (updateItem && i < removeCount && oldItems.at(position + i).id != 0) {
+                const GMenuEntry &removed = oldItems.at(position + i);
+                const quint8 linkFlags = GMenuEntry::HasSection | GMenuEntry::HasSubmenu;
+                if ((removed.flags & linkFlags) == (map.flags & linkFlags)
+                        && removed.link.subscription == map.link.subscription
+                        && removed.link.section == map.link.section) {
+                    map.id = removed.id;
+                    dirtyItems.insert(map.id);
+                } else {
+                    updateItem = false;
+                }
+            } else {
+                updateItem = false;
             }
 
-            if(section.items.count() > change.changePosition + i)
-                section.items.insert(change.changePosition + i, map);
-            else
-                section.items << map;
-
-            // 0 is the menu itself, items start at 1
-            if(updateItem)
-                dirtyItems.insert(Utils::treeStructureToInt(subscription, change.section, change.changePosition + i));
+            items.append(map);
         }
 
+        std::copy(oldItems.constBegin() + position + removeCount, oldItems.constEnd(), std::back_inserter(items));
+        section.items = items;
+
         if(!updateItem)
             dirtyMenus.insert(Utils::treeStructureToInt(subscription, change.section, 0));
     };
 
+    QSet<uint> changedSubscriptions;
+    QSet<uint> changedSections;
+
     for (const auto &change : changes) {
         const int subscription = !menubar && change.subscription == 0 ? START_INDEX : change.subscription;
         // shouldn't happen, it says only Start() subscribes to changes
@@ -338,33 +632,50 @@ void Menu::onMenuChanged(const GMenuChangeList &changes)
         }
 
         auto &menu = m_menus[subscription];
+        changedSubscriptions.insert(subscription);
 
-        bool sectionFound = false;
-        // TODO findSectionRef
-        for (GMenuItem &section : menu) {
-            if (section.section == change.section) {
-                qDebug() << "Updating existing section" << change.section << "in subscription" << change.subscription;
-
-                sectionFound = true;
-                updateSection(subscription, change, section);
-                break;
-            }
-        }
-
-        // Insert new section
-        if (!sectionFound) {
+        auto sectionIt = menu.find(change.section);
+        if (sectionIt != menu.end()) {
+            qDebug() << "Updating existing section" << change.section << "in subscription" << change.subscription;
+        } else {
+            // Insert new section
             qDebug() << "Creating new section" << change.section << "in subscription" << change.subscription;
 
             if (change.itemsToRemoveCount > 0) {
                 qDebug() << "Menu change requested to remove items from a new (and as such empty) section";
             }
 
-            GMenuItem newSection;
-            newSection.id = subscription;
+            MenuSection newSection;
+            newSection.subscription = subscription;
             newSection.section = change.section;
-            updateSection(subscription, change, newSection);
-            menu.append(newSection);
+            sectionIt = menu.insert(newSection.section, newSection);
         }
+
+        // a section changed several times in one go only gets indexed again once everything is applied
+        const uint sectionKey = Utils::treeStructureToInt(subscription, change.section, 0);
+        if (!changedSections.contains(sectionKey)) {
+            unindexSection(*sectionIt);
+            changedSections.insert(sectionKey);
+        }
+
+        updateSection(subscription, change, *sectionIt);
+    }
+
+    for (uint sectionKey : qAsConst(changedSections)) {
+        int subscription, section, index;
+        Utils::intToTreeStructure(sectionKey, subscription, section, index);
+        indexSection(m_menus[subscription][section]);
+    }
+
+    if (!dirtyItems.isEmpty() || !dirtyMenus.isEmpty())
+        m_resolvedSections.clear();
+
+    flushRemovedItems();
+    flushActionReferences();
+
+    for (uint subscription : qAsConst(changedSubscriptions)) {
+        if (m_subscriptions.contains(subscription) && !isPinned(subscription))
+            MenuCache::self()->insert(this, subscription, itemCount(subscription));
     }
 
     // do we have a menu now? let's tell everyone
@@ -381,29 +692,41 @@ void Menu::onMenuChanged(const GMenuChangeList &changes)
         emit menusChanged(dirtyMenus);
 }
 
-void Menu::actionsChanged(const QStringList &dirtyActions, const QString &prefix)
+void Menu::actionsChanged(const QVector<uint> &dirtyActions, quint8 scope)
 {
-    QSet<uint> dirtyItems;
-    QSet<QString> prefixActions;
-    for (const QString &action : dirtyActions) prefixActions.insert(prefix + action);
+    const QSet<uint> dirtyItems = itemsForActions(dirtyActions, scope);
+    if (!dirtyItems.isEmpty())
+        emit itemsChanged(dirtyItems);
+}
+
+QSet<uint> Menu::itemsForActions(const QVector<uint> &actions, quint8 scope) const
+{
+    QSet<uint> items;
+    for (uint action : actions)
+        items.unite(m_actionItems.value(actionKey(scope, action)));
+    return items;
+}
 
-    for (auto it = m_menus.constBegin(), end = m_menus.constEnd(); it != end; ++it) {
-        const int subscription = it.key();
+void Menu::setApplicationActions(Actions *actions)
+{
+    if (m_applicationActions == actions)
+        return;
 
-        for (const auto &menu : it.value()) {
-            const int section = menu.section;
+    if (m_applicationActions)
+        disconnect(m_applicationActions, nullptr, this, nullptr);
 
-            int count = 0;
-            // const auto items = menu.items;
-            for (const auto &item : menu.items) {
-                if (prefixActions.contains(Utils::itemActionName(item)))
-                    dirtyItems.insert(Utils::treeStructureToInt(subscription, section, count));
-                ++count;
-            }
-        }
-    }
+    m_applicationActions = actions;
+    if (!actions)
+        return;
 
-    if (!dirtyItems.isEmpty())
-        emit itemsChanged(dirtyItems);
+    connect(actions, &Actions::actionsChanged, this, [this](const QVector<uint> &dirtyActions) {
+        actionsChanged(dirtyActions, GMenuEntry::ApplicationActions);
+    });
+    connect(actions, &Actions::loaded, this, [this] {
+        actionsChanged(m_applicationActions->all(), GMenuEntry::ApplicationActions);
+    });
+    connect(actions, &Actions::triggerFailed, this, [this](uint action) {
+        actionsChanged({action}, GMenuEntry::ApplicationActions);
+    });
 }
 
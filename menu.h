@@ -20,12 +20,32 @@
 #pragma once
 
 #include <QObject>
+#include <QPointer>
 #include <QString>
 #include <QSet>
+#include <QSharedPointer>
 
 #include "gdbusmenutypes_p.h"
 #include "dbusmenutypes_p.h"
 
+class Actions;
+class SignalDispatcher;
+
+namespace Utils
+{
+class AtomTable;
+}
+
+// A menu section as received from the application, with its items decoded once on arrival
+struct MenuSection
+{
+    uint subscription = 0;
+    uint section = 0;
+    GMenuEntryList items;
+};
+// sections of one subscription by section number
+using MenuSectionHash = QHash<uint, MenuSection>;
+
 class Menu : public QObject
 {
     Q_OBJECT
@@ -34,23 +54,54 @@ public:
     Menu(const QString &serviceName, const QString &objectPath, bool menubar=true, QObject *parent = nullptr);
     ~Menu() override;
 
+    // the one instance for the menu at objectPath of the service, as long as anybody holds on to it
+    static QSharedPointer<Menu> shared(const QString &serviceName, const QString &objectPath, bool menubar);
+
     void init();
     void cleanup();
 
     void start(uint id);
+    void start(const QSet<uint> &ids);
+    // subscribe to all submenus up to the given depth below the top level
+    void prefetch(int depth);
     void stop(const QSet<uint> &ids);
 
+    // the app. actions its items are rendered with, so their changes reach the menu once no matter how many
+    // windows share it; does nothing if it already has them
+    void setApplicationActions(Actions *actions);
+
     bool hasMenu() const;
     bool hasSubscription(uint subscription) const;
-
-    GMenuItem getSection(int id, bool *ok = nullptr) const;
-    GMenuItem getSection(int subscription, int sectionId, bool *ok = nullptr) const;
-
-    QVariantMap getItem(int id) const; // bool ok argument?
-    QVariantMap getItem(int subscription, int sectionId, int id) const;
+    // a client is looking at the subscription, see MenuCache
+    void markUsed(uint subscription);
+
+    // the returned section is only valid until the menu changes, nullptr if we don't have it
+    const MenuSection *getSection(int subscription, int sectionId) const;
+
+    // Items keep their DBusMenu id for as long as they exist, no matter what is inserted or removed
+    // around them. 0 is never given out, it is the top level of the menu.
+    // the returned item is only valid until the menu changes, nullptr if we don't have it
+    const GMenuEntry *getItem(int id) const;
+    // the section the item is currently in
+    bool getItemSection(int id, uint &subscription, uint &section) const;
+
+    // Where a section ends up after following sections that consist of nothing but a ":section" alias
+    struct ResolvedSection
+    {
+        uint subscription;
+        uint section;
+        QList<GMenuSection> path; // every section passed on the way, including the start and the result
+    };
+    ResolvedSection resolveSection(uint subscription, uint section) const;
+
+    // atoms of the actions in the GMenuEntry::ActionScope scope that items we have trigger
+    QVector<uint> referencedActions(quint8 scope) const;
+    // ids of the items triggering any of the actions
+    QSet<uint> itemsForActions(const QVector<uint> &actions, quint8 scope) const;
 
 public slots:
-    void actionsChanged(const QStringList &dirtyActions, const QString &prefix);
+    // dirtyActions are atoms of action names in the GMenuEntry::ActionScope scope
+    void actionsChanged(const QVector<uint> &dirtyActions, quint8 scope);
 
 signals:
     void menuAppeared(); // emitted the first time a menu was successfully loaded
@@ -58,9 +109,12 @@ signals:
 
     void subscribed(uint id);
     void failedToSubscribe(uint id);
+    void unsubscribed(uint id);
 
     void itemsChanged(const QSet<uint> &itemIds);
     void menusChanged(const QSet<uint> &menuIds);
+    void actionsReferenced(); // items for actions we didn't have items for before came in
+    void itemsRemoved(const QSet<uint> &itemIds); // gone with a change or an ended subscription
 
 private slots:
     void onMenuChanged(const GMenuChangeList &changes);
@@ -70,14 +124,52 @@ private:
 
     void menuChanged(const GMenuChangeList &changes);
 
+    void remapLink(GMenuEntry &item) const;
+    // the top level of an application menu, a single "菜单" entry opening the menu of the app
+    void addSyntheticRoot();
+    // gives ids to new items of the section and adds its items to m_items and m_actionItems
+    void indexSection(MenuSection &section);
+    void unindexSection(const MenuSection &section);
+    void flushActionReferences();
+    void flushRemovedItems();
+
+    // the top level is never given up
+    bool isPinned(uint subscription) const;
+    int itemCount(uint subscription) const;
+
+    void collectPrefetch(uint subscription, uint section, int depth, QHash<uint, int> &missing, QSet<uint> &visited) const;
+    void onPrefetched(uint id);
+
     const bool menubar;
     QSet<uint> m_testings;
     // QSet?
     QSet<uint> m_subscriptions; // keeps track of which menu trees we're subscribed to
-
-    QHash<uint, GMenuItemList> m_menus;
+    QHash<uint, int> m_prefetching; // subscriptions being prefetched with the depth left below them
+
+    QHash<uint, MenuSectionHash> m_menus;
+    struct ItemLocation
+    {
+        uint subscription;
+        uint section;
+        int index;
+    };
+    QHash<int, ItemLocation> m_items; // where each item id currently is
+    int m_nextItemId = 1;
+    // item ids by actionKey() of the action they trigger, so action changes don't need to look at every item
+    QHash<quint64, QSet<uint>> m_actionItems;
+    bool m_newActionReferences = false; // m_actionItems got new keys since actionsReferenced() was last emitted
+    QSet<uint> m_removedItems; // unindexed and not indexed again since itemsRemoved() was last emitted
+    // resolveSection() results keyed by tree structure id of the section, dropped on every change to m_menus
+    mutable QHash<uint, ResolvedSection> m_resolvedSections;
 
     QString m_serviceName;
     QString m_objectPath;
 
+    QPointer<Actions> m_applicationActions;
+
+    // gives out GMenuEntry::actionAtom, shared with the Actions of the app
+    QSharedPointer<Utils::AtomTable> m_atoms;
+
+    QSharedPointer<SignalDispatcher> m_signalDispatcher;
+
 };
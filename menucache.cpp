@@ -0,0 +1,154 @@
+/*
+ * Copyright (C) 2018 Kai Uwe Broulik <kde@privat.broulik.de>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#include "menucache.h"
+
+#include <QDebug>
+#include <QSet>
+#include <QTimer>
+#include <QVector>
+#include <algorithm>
+
+#include "menu.h"
+
+MenuCache *MenuCache::self()
+{
+    static MenuCache s_self;
+    return &s_self;
+}
+
+MenuCache::MenuCache()
+    // 0 means no limit
+    : m_budget(qEnvironmentVariableIsSet("GLOBALMENU_CACHE_BUDGET") ? qEnvironmentVariableIntValue("GLOBALMENU_CACHE_BUDGET") : 10000)
+{
+}
+
+void MenuCache::insert(Menu *menu, uint subscription, int itemCount)
+{
+    auto it = m_entries.find(qMakePair(menu, subscription));
+    if (it == m_entries.end()) {
+        it = m_entries.insert(qMakePair(menu, subscription), Entry{0, ++m_clock});
+    }
+
+    m_itemCount += itemCount - it->itemCount;
+    it->itemCount = itemCount;
+
+    scheduleEviction();
+}
+
+void MenuCache::touch(Menu *menu, uint subscription)
+{
+    auto it = m_entries.find(qMakePair(menu, subscription));
+    if (it != m_entries.end()) {
+        it->lastUse = ++m_clock;
+    }
+}
+
+void MenuCache::remove(Menu *menu, uint subscription)
+{
+    auto it = m_entries.find(qMakePair(menu, subscription));
+    if (it != m_entries.end()) {
+        m_itemCount -= it->itemCount;
+        m_entries.erase(it);
+    }
+}
+
+void MenuCache::remove(Menu *menu)
+{
+    for (auto it = m_entries.begin(); it != m_entries.end();) {
+        if (it.key().first == menu) {
+            m_itemCount -= it->itemCount;
+            it = m_entries.erase(it);
+        } else {
+            ++it;
+        }
+    }
+}
+
+void MenuCache::stopFailed(Menu *menu, const QSet<uint> &subscriptions)
+{
+    for (uint subscription : subscriptions) {
+        auto it = m_entries.find(qMakePair(menu, subscription));
+        if (it != m_entries.end()) {
+            it->stopping = false;
+        }
+    }
+}
+
+void MenuCache::scheduleEviction()
+{
+    if (m_budget <= 0 || m_itemCount <= m_budget || m_evictionScheduled) {
+        return;
+    }
+
+    // not while whoever inserted is still busy with the menu
+    m_evictionScheduled = true;
+    QTimer::singleShot(0, [this] {
+        m_evictionScheduled = false;
+        evict();
+    });
+}
+
+void MenuCache::evict()
+{
+    // what we'll have once the subscriptions we are ending already are gone
+    int itemCount = m_itemCount;
+
+    using Key = QPair<Menu *, uint>;
+    QVector<Key> keys;
+    keys.reserve(m_entries.count());
+    for (auto it = m_entries.constBegin(), end = m_entries.constEnd(); it != end; ++it) {
+        if (it->stopping) {
+            itemCount -= it->itemCount;
+        } else {
+            keys.append(it.key());
+        }
+    }
+
+    if (itemCount <= m_budget) {
+        return;
+    }
+
+    std::sort(keys.begin(), keys.end(), [this](const Key &a, const Key &b) {
+        return m_entries.value(a).lastUse < m_entries.value(b).lastUse;
+    });
+    // never throw away what was used last, even if it is bigger than the budget on its own
+    if (!keys.isEmpty()) {
+        keys.removeLast();
+    }
+
+    // end them per menu in one go
+    QHash<Menu *, QSet<uint>> evicted;
+    for (const Key &key : qAsConst(keys)) {
+        if (itemCount <= m_budget) {
+            break;
+        }
+
+        // only counted out by remove() once the menu ended it
+        Entry &entry = m_entries[key];
+        entry.stopping = true;
+        itemCount -= entry.itemCount;
+        evicted[key.first].insert(key.second);
+    }
+
+    for (auto it = evicted.constBegin(), end = evicted.constEnd(); it != end; ++it) {
+        qDebug() << "Evicting subscriptions" << it.value() << "of" << it.key() << "to stay within" << m_budget << "items";
+        it.key()->stop(it.value());
+    }
+}
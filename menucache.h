@@ -0,0 +1,65 @@
+/*
+ * Copyright (C) 2018 Kai Uwe Broulik <kde@privat.broulik.de>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#pragma once
+
+#include <QHash>
+#include <QPair>
+#include <QSet>
+
+class Menu;
+
+// Keeps the number of menu items we hold subscriptions for across all windows
+// below GLOBALMENU_CACHE_BUDGET by ending the subscriptions that were used the longest time ago.
+// Menus re-subscribe on their own once a client asks for an evicted submenu again.
+class MenuCache
+{
+public:
+    static MenuCache *self();
+
+    // a subscription was stored or changed and now holds that many items,
+    // new subscriptions count as just used
+    void insert(Menu *menu, uint subscription, int itemCount);
+    // a client looked at the subscription
+    void touch(Menu *menu, uint subscription);
+    // the subscription was ended, or is gone with its menu
+    void remove(Menu *menu, uint subscription);
+    void remove(Menu *menu);
+    // ending the subscriptions we evicted failed, they still hold their items
+    void stopFailed(Menu *menu, const QSet<uint> &subscriptions);
+
+private:
+    MenuCache();
+
+    void scheduleEviction();
+    void evict();
+
+    struct Entry
+    {
+        int itemCount;
+        quint64 lastUse;
+        bool stopping = false; // evicted, still counted until the menu actually ended it
+    };
+    QHash<QPair<Menu *, uint>, Entry> m_entries;
+
+    const int m_budget;
+    int m_itemCount = 0;
+    quint64 m_clock = 0;
+    bool m_evictionScheduled = false;
+};
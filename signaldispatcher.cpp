@@ -0,0 +1,96 @@
+/*
+ * Copyright (C) 2018 Kai Uwe Broulik <kde@privat.broulik.de>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#include "signaldispatcher.h"
+
+#include <QDBusConnection>
+#include <QDBusMessage>
+#include <QDebug>
+#include <algorithm>
+
+#include "utils.h"
+
+static const QString s_changed = QStringLiteral("Changed");
+
+SignalDispatcher::SignalDispatcher(const QString &serviceName) : QObject()
+    , m_serviceName(serviceName)
+{
+    Q_ASSERT(!serviceName.isEmpty());
+
+    // no path and interface: everything called Changed the service sends, org.gtk.Menus and org.gtk.Actions alike
+    m_connected = QDBusConnection::sessionBus().connect(m_serviceName,
+                                                        QString(),
+                                                        QString(),
+                                                        s_changed,
+                                                        this,
+                                                        SLOT(onChanged(QDBusMessage)));
+    if (!m_connected) {
+        qDebug() << "Failed to subscribe to changes on" << serviceName;
+    }
+}
+
+SignalDispatcher::~SignalDispatcher()
+{
+    if (m_connected) {
+        QDBusConnection::sessionBus().disconnect(m_serviceName,
+                                                 QString(),
+                                                 QString(),
+                                                 s_changed,
+                                                 this,
+                                                 SLOT(onChanged(QDBusMessage)));
+    }
+}
+
+QSharedPointer<SignalDispatcher> SignalDispatcher::forService(const QString &serviceName)
+{
+    static QHash<QString, QWeakPointer<SignalDispatcher>> s_dispatchers;
+    return Utils::sharedInstance(s_dispatchers, serviceName, [&] {
+        return new SignalDispatcher(serviceName);
+    });
+}
+
+void SignalDispatcher::addHandler(QObject *receiver, const QString &objectPath, const QString &interface, const Handler &handler)
+{
+    m_routes[qMakePair(objectPath, interface)].append(Route{receiver, handler});
+}
+
+void SignalDispatcher::removeHandlers(QObject *receiver)
+{
+    for (auto it = m_routes.begin(); it != m_routes.end();) {
+        auto &routes = it.value();
+        routes.erase(std::remove_if(routes.begin(), routes.end(), [receiver](const Route &route) {
+            return route.receiver == receiver;
+        }), routes.end());
+
+        if (routes.isEmpty()) {
+            it = m_routes.erase(it);
+        } else {
+            ++it;
+        }
+    }
+}
+
+void SignalDispatcher::onChanged(const QDBusMessage &message)
+{
+    // copy, handlers might add or remove some
+    const QVector<Route> routes = m_routes.value(qMakePair(message.path(), message.interface()));
+    for (const Route &route : routes) {
+        route.handler(message);
+    }
+}
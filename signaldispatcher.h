@@ -0,0 +1,67 @@
+/*
+ * Copyright (C) 2018 Kai Uwe Broulik <kde@privat.broulik.de>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#pragma once
+
+#include <QHash>
+#include <QObject>
+#include <QPair>
+#include <QSharedPointer>
+#include <QString>
+#include <QVector>
+
+#include <functional>
+
+class QDBusMessage;
+
+// Receives the "Changed" signals of all objects of one GTK service through a single match rule
+// and hands them to whoever registered for the object path and interface they came from
+class SignalDispatcher : public QObject
+{
+    Q_OBJECT
+
+public:
+    ~SignalDispatcher() override;
+
+    // the one dispatcher for the service, as long as anybody holds on to it
+    static QSharedPointer<SignalDispatcher> forService(const QString &serviceName);
+
+    using Handler = std::function<void(const QDBusMessage &message)>;
+
+    void addHandler(QObject *receiver, const QString &objectPath, const QString &interface, const Handler &handler);
+    void removeHandlers(QObject *receiver);
+
+private slots:
+    void onChanged(const QDBusMessage &message);
+
+private:
+    explicit SignalDispatcher(const QString &serviceName);
+
+    QString m_serviceName;
+    bool m_connected = false;
+
+    struct Route
+    {
+        QObject *receiver;
+        Handler handler;
+    };
+    // by object path and interface
+    QHash<QPair<QString, QString>, QVector<Route>> m_routes;
+
+};
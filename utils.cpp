@@ -19,6 +19,12 @@
 
 #include "utils.h"
 
+#include <QHash>
+#include <QSet>
+#include <QSharedPointer>
+#include <QVector>
+#include <algorithm>
+
 int Utils::treeStructureToInt(int subscription, int section, int index)
 {
     return subscription * 1000000 + section * 1000 + index;
@@ -32,11 +38,61 @@ void Utils::intToTreeStructure(int source, int &subscription, int &section, int
     subscription = source / 1000000;
 }
 
-QString Utils::itemActionName(const QVariantMap &item)
+QString Utils::intern(const QString &string)
 {
-    QString actionName = item.value(QStringLiteral("action")).toString();
-    if (actionName.isEmpty()) {
-        actionName = item.value(QStringLiteral("submenu-action")).toString();
+    static QSet<QString> s_strings;
+    static int s_pruneAt = 1024;
+
+    if (string.isEmpty())
+        return QString();
+
+    auto it = s_strings.constFind(string);
+    if (it != s_strings.constEnd())
+        return *it;
+
+    if (s_strings.count() >= s_pruneAt) {
+        // a string only we still reference isn't shared by anything
+        for (auto it = s_strings.begin(); it != s_strings.end();) {
+            if (it->isDetached())
+                it = s_strings.erase(it);
+            else
+                ++it;
+        }
+        // amortized, don't go through all of them on every insert when most are in use
+        s_pruneAt = std::max(1024, s_strings.count() * 2);
     }
-    return actionName;
+
+    s_strings.insert(string);
+    return string;
+}
+
+QSharedPointer<Utils::AtomTable> Utils::AtomTable::forService(const QString &serviceName)
+{
+    static QHash<QString, QWeakPointer<AtomTable>> s_tables;
+    return sharedInstance(s_tables, serviceName, [] { return new AtomTable; });
+}
+
+uint Utils::AtomTable::atom(const QString &string)
+{
+    if (string.isEmpty())
+        return 0;
+
+    auto it = m_atoms.constFind(string);
+    if (it != m_atoms.constEnd())
+        return *it;
+
+    const uint atom = m_strings.count();
+    m_strings.append(string);
+    m_atoms.insert(string, atom);
+    return atom;
+}
+
+uint Utils::AtomTable::find(const QString &string) const
+{
+    return m_atoms.value(string);
+}
+
+QString Utils::AtomTable::string(uint atom) const
+{
+    return m_strings.value(atom);
 }
@@ -19,8 +19,13 @@
 
 #pragma once
 
+#include <QHash>
+#include <QObject>
+#include <QSharedPointer>
 #include <QString>
-#include <QVariantMap>
+#include <QVector>
+
+#include <type_traits>
 
 namespace Utils
 {
@@ -28,6 +33,48 @@ namespace Utils
 int treeStructureToInt(int subscription, int section, int index);
 void intToTreeStructure(int source, int &subscription, int &section, int &index);
 
-QString itemActionName(const QVariantMap &item);
+// returns a shared copy of an equal string seen before, so repeated action names, accels and icons share
+// their data; strings nobody else holds on to any more are dropped from time to time
+QString intern(const QString &string);
+
+namespace Detail
+{
+inline void disposeShared(QObject *object, std::true_type) { object->deleteLater(); }
+template<typename T>
+void disposeShared(T *object, std::false_type) { delete object; }
+}
+
+// Returns the instance registered for key, making one with create() if there is none alive.
+// The key is dropped from the registry as soon as the last reference to its instance goes away.
+template<typename T, typename Key, typename Create>
+QSharedPointer<T> sharedInstance(QHash<Key, QWeakPointer<T>> &registry, const Key &key, Create create)
+{
+    QSharedPointer<T> instance = registry.value(key).toStrongRef();
+    if (!instance) {
+        instance = QSharedPointer<T>(create(), [&registry, key](T *object) {
+            registry.remove(key);
+            // QObjects might still be in the middle of emitting something
+            Detail::disposeShared(object, std::is_base_of<QObject, T>());
+        });
+        registry.insert(key, instance);
+    }
+    return instance;
+}
+
+// Small numbers standing for the action names of one application, 0 for an empty one.
+// Shared by its Menus and Actions and gone with the last of them, so it only ever holds names that application used.
+class AtomTable
+{
+public:
+    static QSharedPointer<AtomTable> forService(const QString &serviceName);
+
+    uint atom(const QString &string); // adds it if it is new
+    uint find(const QString &string) const; // 0 if we never saw it
+    QString string(uint atom) const;
+
+private:
+    QHash<QString, uint> m_atoms;
+    QVector<QString> m_strings{QString()}; // index 0 is the empty string
+};
 
 }
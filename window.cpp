@@ -23,9 +23,12 @@
 #include <QDBusMessage>
 #include <QDBusPendingCallWatcher>
 #include <QDBusPendingReply>
+#include <QDBusServiceWatcher>
 #include <QDebug>
 #include <QList>
 #include <QMutableListIterator>
+#include <QPointer>
+#include <QTimer>
 #include <QVariantList>
 #include <algorithm>
 
@@ -37,89 +40,131 @@
 #include "dbusmenushortcut_p.h"
 #include "dbusmenuadaptor.h"
 
-static const QString s_applicationActionsPrefix = QStringLiteral("app.");
-static const QString s_unityActionsPrefix = QStringLiteral("unity.");
-static const QString s_windowActionsPrefix = QStringLiteral("win.");
-
 Window::Window(const QString &serviceName) : QObject()
     , m_serviceName(serviceName)
+    , m_updateTimer(new QTimer(this))
+    , m_serviceWatcher(new QDBusServiceWatcher(serviceName, QDBusConnection::sessionBus(), QDBusServiceWatcher::WatchForUnregistration, this))
 {
     qDebug() << "Created menu on" << serviceName;
 
     Q_ASSERT(!serviceName.isEmpty());
+
+    // apps like LibreOffice change their menus in bursts (e.g. Undo/Redo on every keystroke),
+    // collect everything changing until the next event loop run (or the configured interval)
+    // and let clients know about it in one go
+    static const int s_updateInterval = qEnvironmentVariableIntValue("GLOBALMENU_UPDATE_INTERVAL");
+    m_updateTimer->setSingleShot(true);
+    m_updateTimer->setInterval(s_updateInterval);
+    connect(m_updateTimer, &QTimer::timeout, this, &Window::sendUpdates);
+
+    // apps that crash or exit don't necessarily get their X window cleaned up before
+    connect(m_serviceWatcher, &QDBusServiceWatcher::serviceUnregistered, this, &Window::onServiceUnregistered);
 }
 
 Window::~Window() {}
 
 void Window::init()
 {
+    m_initTimer.start();
+
     qDebug() << "Inited window with menu for" << m_winId << "on" << m_serviceName << "at app" << m_applicationObjectPath << "win" << m_windowObjectPath << "unity" << m_unityObjectPath;
 
     if (!m_applicationMenuObjectPath.isEmpty()) {
-        m_applicationMenu = new Menu(m_serviceName, m_applicationMenuObjectPath, false, this);
-        connect(m_applicationMenu, &Menu::menuAppeared, this, &Window::updateWindowProperties);
-        connect(m_applicationMenu, &Menu::menuDisappeared, this, &Window::updateWindowProperties);
-        connect(m_applicationMenu, &Menu::subscribed, this, &Window::onMenuSubscribed);
+        // the application menu is the same for all windows of the app
+        m_applicationMenu = Menu::shared(m_serviceName, m_applicationMenuObjectPath, false);
+        connect(m_applicationMenu.data(), &Menu::menuAppeared, this, &Window::updateWindowProperties);
+        connect(m_applicationMenu.data(), &Menu::menuAppeared, this, &Window::prefetchMenu);
+        connect(m_applicationMenu.data(), &Menu::menuDisappeared, this, &Window::updateWindowProperties);
+        connect(m_applicationMenu.data(), &Menu::subscribed, this, &Window::onMenuSubscribed);
         // basically so it replies on DBus no matter what
-        connect(m_applicationMenu, &Menu::failedToSubscribe, this, &Window::onMenuSubscribed);
-        connect(m_applicationMenu, &Menu::itemsChanged, this, &Window::menuItemsChanged);
-        connect(m_applicationMenu, &Menu::menusChanged, this, &Window::menuChanged);
+        connect(m_applicationMenu.data(), &Menu::failedToSubscribe, this, &Window::onMenuSubscribed);
+        connect(m_applicationMenu.data(), &Menu::unsubscribed, this, &Window::onMenuUnsubscribed);
+        connect(m_applicationMenu.data(), &Menu::itemsChanged, this, &Window::menuItemsChanged);
+        connect(m_applicationMenu.data(), &Menu::menusChanged, this, &Window::menuChanged);
+        connect(m_applicationMenu.data(), &Menu::actionsReferenced, this, &Window::describeReferencedActions);
+        connect(m_applicationMenu.data(), &Menu::itemsRemoved, this, &Window::menuItemsRemoved);
     }
 
     if (!m_menuBarObjectPath.isEmpty()) {
         m_menuBar = new Menu(m_serviceName, m_menuBarObjectPath, true, this);
         connect(m_menuBar, &Menu::menuAppeared, this, &Window::updateWindowProperties);
+        connect(m_menuBar, &Menu::menuAppeared, this, &Window::prefetchMenu);
         connect(m_menuBar, &Menu::menuDisappeared, this, &Window::updateWindowProperties);
         connect(m_menuBar, &Menu::subscribed, this, &Window::onMenuSubscribed);
         connect(m_menuBar, &Menu::failedToSubscribe, this, &Window::onMenuSubscribed);
+        connect(m_menuBar, &Menu::unsubscribed, this, &Window::onMenuUnsubscribed);
         connect(m_menuBar, &Menu::itemsChanged, this, &Window::menuItemsChanged);
         connect(m_menuBar, &Menu::menusChanged, this, &Window::menuChanged);
+        connect(m_menuBar, &Menu::actionsReferenced, this, &Window::describeReferencedActions);
+        connect(m_menuBar, &Menu::itemsRemoved, this, &Window::menuItemsRemoved);
     }
 
     if (!m_applicationObjectPath.isEmpty()) {
-        m_applicationActions = new Actions(m_serviceName, m_applicationObjectPath, this);
-        connect(m_applicationActions, &Actions::actionsChanged, this, [this](const QStringList &dirtyActions) {
-            onActionsChanged(dirtyActions, s_applicationActionsPrefix);
+        // as are its app. actions
+        m_applicationActions = Actions::shared(m_serviceName, m_applicationObjectPath);
+        // the shared pair is joined once, not by every window
+        if (m_applicationMenu)
+            m_applicationMenu->setApplicationActions(m_applicationActions.data());
+        connect(m_applicationActions.data(), &Actions::actionsChanged, this, [this](const QVector<uint> &dirtyActions) {
+            onActionsChanged(dirtyActions, GMenuEntry::ApplicationActions);
         });
-        connect(m_applicationActions, &Actions::loaded, this, [this] {
-            if (m_menuInited) {
-                onActionsChanged(m_applicationActions->getAll().keys(), s_applicationActionsPrefix);
-            } else {
-                initMenu();
-            }
+        // render its items again, if the action is gone for good they show up disabled now
+        connect(m_applicationActions.data(), &Actions::triggerFailed, this, [this](uint action) {
+            onActionsChanged({action}, GMenuEntry::ApplicationActions);
+        });
+        connect(m_applicationActions.data(), &Actions::loaded, this, [this] {
+            describeReferencedActions();
+            onActionsChanged(m_applicationActions->all(), GMenuEntry::ApplicationActions);
+            onActionsLoadFinished();
         });
-        m_applicationActions->load();
+        connect(m_applicationActions.data(), &Actions::failedToLoad, this, &Window::onActionsLoadFinished);
+        // another window of the app might have loaded them already
+        if (!m_applicationActions->isLoaded()) {
+            ++m_pendingActionLoads;
+            m_applicationActions->load();
+        }
     }
 
     if (!m_unityObjectPath.isEmpty()) {
         m_unityActions = new Actions(m_serviceName, m_unityObjectPath, this);
-        connect(m_unityActions, &Actions::actionsChanged, this, [this](const QStringList &dirtyActions) {
-            onActionsChanged(dirtyActions, s_unityActionsPrefix);
+        connect(m_unityActions, &Actions::actionsChanged, this, [this](const QVector<uint> &dirtyActions) {
+            onActionsChanged(dirtyActions, GMenuEntry::UnityActions);
+        });
+        // render its items again, if the action is gone for good they show up disabled now
+        connect(m_unityActions, &Actions::triggerFailed, this, [this](uint action) {
+            onActionsChanged({action}, GMenuEntry::UnityActions);
         });
         connect(m_unityActions, &Actions::loaded, this, [this] {
-            if (m_menuInited) {
-                onActionsChanged(m_unityActions->getAll().keys(), s_unityActionsPrefix);
-            } else {
-                initMenu();
-            }
+            describeReferencedActions();
+            onActionsChanged(m_unityActions->all(), GMenuEntry::UnityActions);
+            onActionsLoadFinished();
         });
+        connect(m_unityActions, &Actions::failedToLoad, this, &Window::onActionsLoadFinished);
+        ++m_pendingActionLoads;
         m_unityActions->load();
     }
 
     if (!m_windowObjectPath.isEmpty()) {
         m_windowActions = new Actions(m_serviceName, m_windowObjectPath, this);
-        connect(m_windowActions, &Actions::actionsChanged, this, [this](const QStringList &dirtyActions) {
-            onActionsChanged(dirtyActions, s_windowActionsPrefix);
+        connect(m_windowActions, &Actions::actionsChanged, this, [this](const QVector<uint> &dirtyActions) {
+            onActionsChanged(dirtyActions, GMenuEntry::WindowActions);
+        });
+        // render its items again, if the action is gone for good they show up disabled now
+        connect(m_windowActions, &Actions::triggerFailed, this, [this](uint action) {
+            onActionsChanged({action}, GMenuEntry::WindowActions);
         });
         connect(m_windowActions, &Actions::loaded, this, [this] {
-            if (m_menuInited) {
-                onActionsChanged(m_windowActions->getAll().keys(), s_windowActionsPrefix);
-            } else {
-                initMenu();
-            }
+            describeReferencedActions();
+            onActionsChanged(m_windowActions->all(), GMenuEntry::WindowActions);
+            onActionsLoadFinished();
         });
+        connect(m_windowActions, &Actions::failedToLoad, this, &Window::onActionsLoadFinished);
+        ++m_pendingActionLoads;
         m_windowActions->load();
     }
+
+    // the menu structure doesn't depend on the actions, fetch it alongside them
+    initMenu();
 }
 
 WId Window::winId() const
@@ -211,103 +256,420 @@ void Window::initMenu()
     if (m_menuBar) m_menuBar->start(0);
 
     m_menuInited = true;
+
+    logPhase("menu requested");
+
+    // when shared with another window of the app it might be there already and won't announce itself again
+    if (m_applicationMenu && m_applicationMenu->hasMenu())
+        updateWindowProperties();
+}
+
+void Window::onActionsLoadFinished()
+{
+    if (m_pendingActionLoads == 0 || --m_pendingActionLoads > 0)
+        return;
+
+    logPhase("actions loaded");
+
+    // items can be rendered properly now, answer whoever asked in the meantime
+    QSet<uint> nextSubscriptions;
+    for (auto it = m_pendingGetLayouts.begin(); it != m_pendingGetLayouts.end();) {
+        if (!it->waitingForActions) {
+            ++it;
+            continue;
+        }
+
+        it->waitingForActions = false;
+        if (finishPendingLayout(*it, nextSubscriptions)) {
+            it = m_pendingGetLayouts.erase(it);
+        } else {
+            ++it;
+        }
+    }
+
+    if (!nextSubscriptions.isEmpty() && m_currentMenu)
+        m_currentMenu->start(nextSubscriptions);
+
+    if (!m_dirtyItems.isEmpty() || !m_dirtyParents.isEmpty())
+        scheduleUpdate();
+}
+
+void Window::logPhase(const char *phase) const
+{
+    qDebug() << "Window" << m_winId << "on" << m_serviceName << phase << "after" << m_initTimer.elapsed() << "ms";
 }
 
 void Window::menuItemsChanged(const QSet<uint> &itemIds)
 {
-    if (qobject_cast<Menu*>(sender()) == m_currentMenu) {
-        DBusMenuItemList items;
+    // this is also where changes of Actions end up, through Menu::actionsChanged
+    markItemsDirty(qobject_cast<Menu*>(sender()), itemIds);
+}
 
+void Window::markItemsDirty(Menu *menu, const QSet<uint> &itemIds)
+{
+    if (menu && menu == m_currentMenu && !itemIds.isEmpty()) {
+        QSet<uint> sectionIds;
         for (uint id : itemIds) {
-            const auto newItem = m_currentMenu->getItem(id);
-
-            DBusMenuItem dBusItem{
-                // 0 is menu, items start at 1
-                static_cast<int>(id),
-                gMenuToDBusMenuProperties(newItem)
-            };
-            items.append(dBusItem);
+            uint subscription, section;
+            if (m_currentMenu->getItemSection(id, subscription, section))
+                sectionIds.insert(Utils::treeStructureToInt(subscription, section, 0));
         }
+        invalidateLayouts(sectionIds);
 
-        emit ItemsPropertiesUpdated(items, {});
+        m_dirtyItems.unite(itemIds);
+        scheduleUpdate();
+    }
+}
+
+void Window::menuItemsRemoved(const QSet<uint> &itemIds)
+{
+    // ids are never given out again, nothing will need to be compared against what we sent for them
+    // and a submenu that is gone won't be laid out again either
+    if (qobject_cast<Menu*>(sender()) == m_currentMenu) {
+        for (uint id : itemIds) {
+            m_sentProperties.remove(id);
+            m_layoutCache.remove(id);
+            unlinkLayout(id);
+        }
     }
 }
 
 void Window::menuChanged(const QSet<uint> &menuIds)
 {
     if (qobject_cast<Menu*>(sender()) == m_currentMenu) {
-        QSet<int> sids;
-        for (uint id : menuIds) {
-            int subscription, section, index;
-            Utils::intToTreeStructure(id, subscription, section, index);
-            sids.insert(subscription);
+        // if nobody got a layout containing it from us yet, there is nobody to tell either
+        const QSet<int> parentIds = invalidateLayouts(menuIds);
+        if (parentIds.isEmpty())
+            return;
+
+        ++m_revision;
+        m_dirtyParents.unite(parentIds);
+        scheduleUpdate();
+    }
+}
+
+void Window::scheduleUpdate()
+{
+    if (!m_updateTimer->isActive())
+        m_updateTimer->start();
+}
+
+void Window::sendUpdates()
+{
+    if (!m_currentMenu) {
+        m_dirtyItems.clear();
+        m_dirtyParents.clear();
+        return;
+    }
+
+    // sent once the actions are in, see onActionsLoadFinished()
+    if (m_pendingActionLoads > 0)
+        return;
+
+    DBusMenuItemList items;
+    DBusMenuItemKeysList removedItems;
+
+    for (uint id : qAsConst(m_dirtyItems)) {
+        uint subscription, section;
+        const GMenuEntry *newItem = m_currentMenu->getItem(id);
+        // removed again in the meantime
+        if (!newItem || !m_currentMenu->getItemSection(id, subscription, section))
+            continue;
+
+        // clients fetch it again anyway when all layouts it is part of are updated
+        const QSet<int> parentIds = m_layoutCacheSections.value(Utils::treeStructureToInt(subscription, section, 0));
+        if (!parentIds.isEmpty() && m_dirtyParents.contains(parentIds))
+            continue;
+
+        const QVariantMap properties = gMenuToDBusMenuProperties(*newItem);
+
+        // only send what changed since the client last got the item from us
+        auto sentIt = m_sentProperties.find(id);
+        if (sentIt == m_sentProperties.end()) {
+            // 0 is menu, items start at 1
+            items.append(DBusMenuItem{static_cast<int>(id), properties});
+            m_sentProperties.insert(id, properties);
+            continue;
+        }
+
+        DBusMenuItem dBusItem{static_cast<int>(id), {}};
+        for (auto it = properties.constBegin(), end = properties.constEnd(); it != end; ++it) {
+            auto oldIt = sentIt->constFind(it.key());
+            if (oldIt == sentIt->constEnd() || *oldIt != *it)
+                dBusItem.properties.insert(it.key(), *it);
+        }
+
+        DBusMenuItemKeys removedKeys{static_cast<int>(id), {}};
+        for (auto it = sentIt->constBegin(), end = sentIt->constEnd(); it != end; ++it) {
+            if (!properties.contains(it.key()))
+                removedKeys.properties.append(it.key());
         }
-        for(auto subscription : sids)
-            emit LayoutUpdated(3 /*revision*/, subscription);
+
+        *sentIt = properties;
+
+        if (!dBusItem.properties.isEmpty())
+            items.append(dBusItem);
+        if (!removedKeys.properties.isEmpty())
+            removedItems.append(removedKeys);
     }
+
+    const QSet<int> parentIds = m_dirtyParents;
+
+    m_dirtyItems.clear();
+    m_dirtyParents.clear();
+
+    if (!items.isEmpty() || !removedItems.isEmpty())
+        emit ItemsPropertiesUpdated(items, removedItems);
+
+    for (int parentId : parentIds)
+        emit LayoutUpdated(m_revision, parentId);
 }
 
 void Window::onMenuSubscribed(uint id)
 {
-    // When it was a delayed GetLayout request, send the reply now
-    const auto pendingReplies = m_pendingGetLayouts.values(id);
-    if (!pendingReplies.isEmpty()) {
-        for (const auto &pendingReply : pendingReplies) {
-            if (pendingReply.type() != QDBusMessage::InvalidMessage) {
-                auto reply = pendingReply.createReply();
+    QSet<int> parentIds;
+    const bool isCurrentMenu = qobject_cast<Menu*>(sender()) == m_currentMenu;
+    if (isCurrentMenu) {
+        // aliases into this subscription might have been laid out empty before
+        parentIds = invalidateLayoutsForSubscription(id);
+        parentIds.unite(m_preparingParents.take(id));
+        ++m_revision;
+    }
 
-                DBusMenuLayoutItem item;
-                uint revision = GetLayout(Utils::treeStructureToInt(id, 0, 0), 1, {}, item);
+    // When it was a delayed GetLayout request, send the reply now
+    bool wasPending = false;
+    QSet<uint> nextSubscriptions;
+    for (auto it = m_pendingGetLayouts.begin(); it != m_pendingGetLayouts.end();) {
+        if (!it->waitingFor.remove(id)) {
+            ++it;
+            continue;
+        }
 
-                reply << revision << QVariant::fromValue(item);
+        wasPending = true;
+        if (!it->waitingFor.isEmpty() || it->waitingForActions) {
+            ++it;
+            continue;
+        }
 
-                QDBusConnection::sessionBus().send(reply);
-            }
+        if (finishPendingLayout(*it, nextSubscriptions)) {
+            it = m_pendingGetLayouts.erase(it);
+        } else {
+            ++it;
         }
-        m_pendingGetLayouts.remove(id);
-    } else {
-        emit LayoutUpdated(2 /*revision*/, id);
     }
+
+    if (!nextSubscriptions.isEmpty() && m_currentMenu)
+        m_currentMenu->start(nextSubscriptions);
+
+    // nothing to tell if nobody asked for it yet, e.g. when it was prefetched
+    if (!wasPending && isCurrentMenu && !parentIds.isEmpty()) {
+        m_dirtyParents.unite(parentIds);
+        scheduleUpdate();
+    }
+}
+
+bool Window::finishPendingLayout(PendingGetLayout &pending, QSet<uint> &nextSubscriptions)
+{
+    DBusMenuLayoutItem item;
+    QSet<uint> missingSubscriptions;
+    if (m_currentMenu)
+        buildLayout(pending.parentId, pending.recursionDepth, pending.propertyNames, item, missingSubscriptions);
+
+    // don't ask again for what failed already, it will be laid out empty
+    missingSubscriptions.subtract(pending.requested);
+    if (!missingSubscriptions.isEmpty()) {
+        // the submenus we just got reference further ones, fetch the next level in one go
+        pending.waitingFor = missingSubscriptions;
+        pending.requested.unite(missingSubscriptions);
+        nextSubscriptions.unite(missingSubscriptions);
+        return false;
+    }
+
+    auto reply = pending.message.createReply();
+    reply << m_revision << QVariant::fromValue(item);
+    QDBusConnection::sessionBus().send(reply);
+
+    return true;
+}
+
+void Window::onServiceUnregistered()
+{
+    qDebug() << "Service" << m_serviceName << "of window" << m_winId << "went away, dropping its menus";
+
+    // what they are waiting for will never arrive, answer with what we have, which is nothing
+    for (const PendingGetLayout &pending : qAsConst(m_pendingGetLayouts)) {
+        DBusMenuLayoutItem item;
+        item.id = pending.parentId;
+
+        auto reply = pending.message.createReply();
+        reply << m_revision << QVariant::fromValue(item);
+        QDBusConnection::sessionBus().send(reply);
+    }
+    m_pendingGetLayouts.clear();
+    m_pendingActionLoads = 0;
+
+    m_updateTimer->stop();
+    clearLayoutCache();
+    ++m_revision;
+
+    // deleting them also removes their match rules
+    m_currentMenu = nullptr;
+    m_applicationMenu.reset();
+    delete m_menuBar;
+    m_menuBar = nullptr;
+
+    m_applicationActions.reset();
+    delete m_unityActions;
+    m_unityActions = nullptr;
+    delete m_windowActions;
+    m_windowActions = nullptr;
+
+    emit requestRemoveWindowProperties();
+}
+
+void Window::onMenuUnsubscribed(uint id)
+{
+    // evicted, don't serve layouts we can no longer back with items,
+    // the next request for them subscribes again
+    if (qobject_cast<Menu*>(sender()) == m_currentMenu)
+        invalidateLayoutsForSubscription(id);
+}
+
+void Window::recordSentProperties(int id, const QVariantMap &properties, const QStringList &propertyNames)
+{
+    if (propertyNames.isEmpty()) {
+        m_sentProperties.insert(id, properties);
+        return;
+    }
+
+    // only what was asked for got sent, leave the rest as it was
+    QVariantMap &sentProperties = m_sentProperties[id];
+    for (const QString &propertyName : propertyNames) {
+        auto it = properties.constFind(propertyName);
+        if (it != properties.constEnd())
+            sentProperties.insert(propertyName, *it);
+        else
+            sentProperties.remove(propertyName);
+    }
+}
+
+void Window::cacheLayout(int parentId, const LayoutLevel &level, const QSet<uint> &sectionIds)
+{
+    // it might be built from different sections now
+    unlinkLayout(parentId);
+
+    m_layoutCache.insert(parentId, level);
+    for (uint sectionId : sectionIds)
+        m_layoutCacheSections[sectionId].insert(parentId);
+    m_layoutSections.insert(parentId, sectionIds);
+}
+
+void Window::unlinkLayout(int parentId)
+{
+    const QSet<uint> sectionIds = m_layoutSections.take(parentId);
+    for (uint sectionId : sectionIds) {
+        auto it = m_layoutCacheSections.find(sectionId);
+        if (it == m_layoutCacheSections.end())
+            continue;
+
+        it->remove(parentId);
+        if (it->isEmpty())
+            m_layoutCacheSections.erase(it);
+    }
+}
+
+QSet<int> Window::invalidateLayouts(const QSet<uint> &sectionIds)
+{
+    QSet<int> parentIds;
+    for (uint sectionId : sectionIds)
+        parentIds.unite(m_layoutCacheSections.value(sectionId));
+
+    // keep the links, the client might not have been told to fetch it again (item changes only update properties),
+    // they are replaced once it is built again
+    for (int parentId : qAsConst(parentIds))
+        m_layoutCache.remove(parentId);
+
+    return parentIds;
+}
+
+QSet<int> Window::invalidateLayoutsForSubscription(uint subscription)
+{
+    QSet<uint> sectionIds;
+    for (auto it = m_layoutCacheSections.constBegin(), end = m_layoutCacheSections.constEnd(); it != end; ++it) {
+        int sectionSubscription, section, index;
+        Utils::intToTreeStructure(it.key(), sectionSubscription, section, index);
+        if (static_cast<uint>(sectionSubscription) == subscription)
+            sectionIds.insert(it.key());
+    }
+    return invalidateLayouts(sectionIds);
+}
+
+void Window::clearLayoutCache()
+{
+    m_layoutCache.clear();
+    m_layoutCacheSections.clear();
+    m_layoutSections.clear();
+    m_preparingParents.clear();
+    m_sentProperties.clear();
+
+    // whatever was pending is covered by the update of the entire menu
+    m_dirtyItems.clear();
+    m_dirtyParents.clear();
 }
 
-bool Window::getAction(const QString &name, GMenuAction &action) const
+const GMenuAction *Window::getAction(const GMenuEntry &item) const
 {
-    QString lookupName;
-    if(Actions *actions = getActionsForAction(name, lookupName))
-        return actions->get(lookupName, action);
-    return false;
+    if(Actions *actions = getActionsForScope(item.actionScope))
+        return actions->get(item.actionAtom);
+    return nullptr;
 }
 
-void Window::triggerAction(const QString &name, const QVariant &target, uint timestamp)
+void Window::triggerAction(const GMenuEntry &item, uint timestamp)
 {
-    QString lookupName;
-    if(Actions *actions = getActionsForAction(name, lookupName))
-        actions->trigger(lookupName, target, timestamp);
+    if(Actions *actions = getActionsForScope(item.actionScope))
+        actions->trigger(item.actionAtom, item.target, timestamp);
 }
 
-Actions *Window::getActionsForAction(const QString &name, QString &lookupName) const
+Actions *Window::getActionsForScope(quint8 scope) const
 {
-    if (name.startsWith(QLatin1String("app."))) {
-        lookupName = name.mid(4);
-        return m_applicationActions;
-    } else if (name.startsWith(QLatin1String("unity."))) {
-        lookupName = name.mid(6);
+    switch (scope) {
+    case GMenuEntry::ApplicationActions:
+        return m_applicationActions.data();
+    case GMenuEntry::UnityActions:
         return m_unityActions;
-    } else if (name.startsWith(QLatin1String("win."))) {
-        lookupName = name.mid(4);
+    case GMenuEntry::WindowActions:
         return m_windowActions;
     }
 
     return nullptr;
 }
 
-void Window::onActionsChanged(const QStringList &dirty, const QString &prefix)
+void Window::describeReferencedActions()
 {
-    if (m_applicationMenu) {
-        m_applicationMenu->actionsChanged(dirty, prefix);
+    static const quint8 s_scopes[] = {GMenuEntry::ApplicationActions, GMenuEntry::UnityActions, GMenuEntry::WindowActions};
+
+    for (quint8 scope : s_scopes) {
+        Actions *actions = getActionsForScope(scope);
+        if (!actions || !actions->isLazy())
+            continue;
+
+        if (m_applicationMenu)
+            actions->describe(m_applicationMenu->referencedActions(scope));
+        if (m_menuBar)
+            actions->describe(m_menuBar->referencedActions(scope));
     }
+}
+
+void Window::onActionsChanged(const QVector<uint> &dirty, quint8 scope)
+{
     if (m_menuBar) {
-        m_menuBar->actionsChanged(dirty, prefix);
+        m_menuBar->actionsChanged(dirty, scope);
+    }
+
+    // the shared application menu gets app. changes straight from the Actions, see Menu::setApplicationActions();
+    // our win. and unity. actions only change how this window shows it, leave the other windows alone
+    if (m_applicationMenu && scope != GMenuEntry::ApplicationActions) {
+        markItemsDirty(m_applicationMenu.data(), m_applicationMenu->itemsForActions(dirty, scope));
     }
 }
 
@@ -333,30 +695,57 @@ bool Window::registerDBusObject()
     return true;
 }
 
+void Window::prefetchMenu()
+{
+    // subscribe to the submenus before the user opens them, so the first open is served from memory
+    static const int s_prefetchDepth = qEnvironmentVariableIsSet("GLOBALMENU_PREFETCH_DEPTH") ? qEnvironmentVariableIntValue("GLOBALMENU_PREFETCH_DEPTH") : 1;
+    if (s_prefetchDepth <= 0)
+        return;
+
+    QPointer<Menu> menu = qobject_cast<Menu*>(sender());
+    if (!menu)
+        return;
+
+    // low priority, let whatever else is queued (like the panel asking for the menu bar) go first
+    QTimer::singleShot(0, this, [menu] {
+        if (menu)
+            menu->prefetch(s_prefetchDepth);
+    });
+}
+
 void Window::updateWindowProperties()
 {
     const bool hasMenu = ((m_applicationMenu && m_applicationMenu->hasMenu()) || (m_menuBar && m_menuBar->hasMenu()));
 
     if (!hasMenu) {
+        clearLayoutCache();
+        ++m_revision;
         emit requestRemoveWindowProperties();
         return;
     }
 
     Menu *oldMenu = m_currentMenu;
     Menu *newMenu = qobject_cast<Menu*>(sender());
+    // called from initMenu() for a shared application menu that was there before this window
+    if (!newMenu)
+        newMenu = m_applicationMenu.data();
     // set current menu as needed
     if (!m_currentMenu) {
         m_currentMenu = newMenu;
     // Menu Bar takes precedence over application menu
-    } else if (m_currentMenu == m_applicationMenu && newMenu == m_menuBar) {
+    } else if (m_currentMenu == m_applicationMenu.data() && newMenu == m_menuBar) {
         qDebug() << "Switching from application menu to menu bar";
         m_currentMenu = newMenu;
         // TODO update layout
     }
 
     if (m_currentMenu != oldMenu) {
+        if (!oldMenu)
+            logPhase("menu ready");
+        clearLayoutCache();
+        ++m_revision;
         // update entire menu now
-        emit LayoutUpdated(4 /*revision*/, 0);
+        emit LayoutUpdated(m_revision, 0);
     }
 
     emit requestWriteWindowProperties();
@@ -365,10 +754,46 @@ void Window::updateWindowProperties()
 // DBus
 bool Window::AboutToShow(int id)
 {
-    // We always request the first time GetLayout is called and keep up-to-date internally
-    // No need to have us prepare anything here
-    Q_UNUSED(id);
-    return false;
+    QList<int> idErrors;
+    return AboutToShowGroup({id}, idErrors).contains(id);
+}
+
+QList<int> Window::AboutToShowGroup(const QList<int> &ids, QList<int> &idErrors)
+{
+    // We keep everything up-to-date internally once subscribed, all there is to prepare
+    // is starting the subscriptions the menus need, all of them in one go
+    QList<int> updatesNeeded;
+
+    if (!m_currentMenu) {
+        idErrors = ids;
+        return updatesNeeded;
+    }
+
+    QSet<uint> missingSubscriptions;
+    for (int id : ids) {
+        QSet<uint> levelMissingSubscriptions;
+        if (!findMissingSubscriptions(id, levelMissingSubscriptions)) {
+            idErrors.append(id);
+            continue;
+        }
+
+        if (levelMissingSubscriptions.isEmpty()) {
+            // about to be fetched, keep it around
+            if (m_layoutCache.contains(id))
+                markLayoutUsed(id);
+            continue;
+        }
+
+        updatesNeeded.append(id);
+        for (uint subscription : qAsConst(levelMissingSubscriptions))
+            m_preparingParents[subscription].insert(id);
+        missingSubscriptions.unite(levelMissingSubscriptions);
+    }
+
+    if (!missingSubscriptions.isEmpty())
+        m_currentMenu->start(missingSubscriptions);
+
+    return updatesNeeded;
 }
 
 void Window::Event(int id, const QString &eventId, const QDBusVariant &data, uint timestamp)
@@ -380,42 +805,45 @@ void Window::Event(int id, const QString &eventId, const QDBusVariant &data, uin
     // GMenu dbus doesn't have any "opened" or "closed" signals, we'll only handle "clicked"
 
     if (eventId == QLatin1String("clicked")) {
-        const QVariantMap item = m_currentMenu->getItem(id);
+        const GMenuEntry *item = m_currentMenu->getItem(id);
 
-        if(item.contains(QLatin1String(":submenu"))) return;
+        if(!item || item->isSubmenu()) return;
 
-        const QString action = item.value(QStringLiteral("action")).toString();
-        const QVariant target = item.value(QStringLiteral("target"));
-        if (!action.isEmpty())
-            triggerAction(action, target, timestamp);
+        if (!item->action.isEmpty())
+            triggerAction(*item, timestamp);
     }
 }
 
+QList<int> Window::EventGroup(const DBusMenuEventList &events)
+{
+    QList<int> idErrors;
+
+    for (const DBusMenuEvent &event : events) {
+        if (!m_currentMenu || !m_currentMenu->getItem(event.id)) {
+            idErrors.append(event.id);
+            continue;
+        }
+
+        Event(event.id, event.eventId, event.data, event.timestamp);
+    }
+
+    return idErrors;
+}
+
 DBusMenuItemList Window::GetGroupProperties(const QList<int> &ids, const QStringList &propertyNames)
 {
     DBusMenuItemList retValues;
 
     if(m_currentMenu && !ids.isEmpty()) {
+        retValues.reserve(ids.count());
+
         for(const auto id : ids) {
             DBusMenuItem item;
             item.id = id;
 
-            int subscription, sectionId, indexId;
-            Utils::intToTreeStructure(id, subscription, sectionId, indexId);
-
-            if (m_currentMenu->hasSubscription(subscription)) {
-                bool ok;
-                GMenuItem section = m_currentMenu->getSection(subscription, sectionId, &ok);
-
-                if (ok && (section.items.count() > indexId)) {
-                    auto tmpItem = section.items.at(indexId);
-                    if(propertyNames.isEmpty())
-                        item.properties.insert(tmpItem);
-                    else
-                        for(auto &property : propertyNames)
-                            if(tmpItem.contains(property))
-                                item.properties.insert(property, tmpItem.value(property));
-                }
+            if (const GMenuEntry *entry = m_currentMenu->getItem(id)) {
+                item.properties = gMenuToDBusMenuProperties(*entry, propertyNames);
+                recordSentProperties(id, item.properties, propertyNames);
             }
 
             retValues.append(item);
@@ -428,107 +856,203 @@ DBusMenuItemList Window::GetGroupProperties(const QList<int> &ids, const QString
 uint Window::GetLayout(int parentId, int recursionDepth, const QStringList &propertyNames, DBusMenuLayoutItem &dbusItem)
 {
     if (!m_currentMenu) {
-        return 1;
+        return m_revision;
     }
 
-    int subscription, sectionId, indexId;
-    Utils::intToTreeStructure(parentId, subscription, sectionId, indexId);
+    // enabled, visible and toggle state come from the actions, don't lay out items without them
+    if (m_pendingActionLoads > 0 && calledFromDBus()) {
+        m_pendingGetLayouts.append(PendingGetLayout{message(), parentId, recursionDepth, propertyNames, {}, {}, true});
+        setDelayedReply(true);
+        return m_revision;
+    }
 
-    if (!m_currentMenu->hasSubscription(subscription)) {
-        // let's serve multiple similar requests in one go once we've processed them
-        m_pendingGetLayouts.insert(subscription, message());
+    QSet<uint> missingSubscriptions;
+    buildLayout(parentId, recursionDepth, propertyNames, dbusItem, missingSubscriptions);
+
+    if (!missingSubscriptions.isEmpty() && calledFromDBus()) {
+        // start everything the requested tree needs at once and reply when all of it arrived
+        m_pendingGetLayouts.append(PendingGetLayout{message(), parentId, recursionDepth, propertyNames,
+                                                    missingSubscriptions, missingSubscriptions, false});
         setDelayedReply(true);
 
-        m_currentMenu->start(subscription);
-        return 1;
+        m_currentMenu->start(missingSubscriptions);
     }
 
-    bool ok;
-    GMenuItem section = m_currentMenu->getSection(subscription, sectionId, &ok);
+    return m_revision;
+}
+
+void Window::buildLayout(int parentId, int recursionDepth, const QStringList &propertyNames, DBusMenuLayoutItem &dbusItem, QSet<uint> &missingSubscriptions)
+{
+    QSet<int> parentIds;
+    buildLayout(parentId, recursionDepth, propertyNames, dbusItem, missingSubscriptions, parentIds);
+}
+
+void Window::buildLayout(int parentId, int recursionDepth, const QStringList &propertyNames, DBusMenuLayoutItem &dbusItem, QSet<uint> &missingSubscriptions, QSet<int> &parentIds)
+{
+    dbusItem.id = parentId;
+
+    LayoutLevel level;
+    if (!layoutLevel(parentId, propertyNames, level, missingSubscriptions))
+        return;
+
+    dbusItem = level.layout;
 
-    if (!ok || (section.items.count() < indexId)) {
-        qDebug() << "There is no section on" << subscription << "at" << 0 << "with" << indexId;
-        return 1;
+    // -1 means the entire tree, 0 just the item itself
+    if (recursionDepth == 0) {
+        dbusItem.children.clear();
+        return;
     }
 
-    auto tmpItem = section.items.at(indexId);
-    if(tmpItem.contains(QLatin1String(":submenu")))
-    {
-        GMenuSection gmenuSection = tmpItem.value(QLatin1String(":submenu")).value<GMenuSection>();
-        subscription = gmenuSection.subscription;
-        sectionId = gmenuSection.section;
-        indexId = 0;
+    if (recursionDepth == 1)
+        return;
+
+    // guard against submenus that (indirectly) contain themselves
+    parentIds.insert(parentId);
+
+    for (auto &child : dbusItem.children) {
+        // children-display might not have been asked for, so don't rely on the properties
+        if (parentIds.contains(child.id) || !level.submenuIds.contains(child.id))
+            continue;
+
+        DBusMenuLayoutItem submenu;
+        buildLayout(child.id, recursionDepth < 0 ? -1 : recursionDepth - 1, propertyNames, submenu, missingSubscriptions, parentIds);
+        child.children = submenu.children;
+    }
 
-        if (!m_currentMenu->hasSubscription(subscription)) {
-            // let's serve multiple similar requests in one go once we've processed them
-            m_pendingGetLayouts.insert(subscription, message());
-            setDelayedReply(true);
+    parentIds.remove(parentId);
+}
 
-            m_currentMenu->start(subscription);
-            return 1;
+bool Window::submenuSection(int parentId, uint &subscription, uint &sectionId) const
+{
+    // 0 is the top level, anything else has to be an item opening a submenu
+    subscription = 0;
+    sectionId = 0;
+    if (parentId != 0) {
+        const GMenuEntry *parentItem = m_currentMenu->getItem(parentId);
+        if (!parentItem || !parentItem->isSubmenu()) {
+            qDebug() << "There is no submenu with id" << parentId;
+            return false;
         }
 
-        section = m_currentMenu->getSection(subscription, sectionId, &ok);
+        subscription = parentItem->link.subscription;
+        sectionId = parentItem->link.section;
+    }
+    return true;
+}
+
+bool Window::findMissingSubscriptions(int parentId, QSet<uint> &missingSubscriptions) const
+{
+    uint subscription, sectionId;
+    if (!submenuSection(parentId, subscription, sectionId))
+        return false;
+
+    if (!m_currentMenu->hasSubscription(subscription)) {
+        missingSubscriptions.insert(subscription);
+        return true;
+    }
+
+    const MenuSection *section = m_currentMenu->getSection(subscription, sectionId);
+    if (!section) {
+        qDebug() << "There is no section" << sectionId << "on" << subscription;
+        return false;
+    }
 
-        if (!ok || (section.items.count() < indexId)) {
-            qDebug() << "There is no section on" << subscription << "at" << 0 << "with" << indexId;
-            return 1;
+    // the same aliases layoutLevel() follows
+    for (const auto &item : section->items) {
+        if (!item.isSection())
+            continue;
+
+        const Menu::ResolvedSection resolved = m_currentMenu->resolveSection(item.link.subscription, item.link.section);
+        for (const GMenuSection &aliasSection : resolved.path) {
+            if (!m_currentMenu->hasSubscription(aliasSection.subscription))
+                missingSubscriptions.insert(aliasSection.subscription);
         }
     }
+    return true;
+}
 
-    dbusItem.id = Utils::treeStructureToInt(subscription, sectionId, indexId); // TODO
-    dbusItem.properties = {
-        {QStringLiteral("children-display"), QStringLiteral("submenu")}
-    };
+bool Window::layoutLevel(int parentId, const QStringList &propertyNames, LayoutLevel &level, QSet<uint> &missingSubscriptions)
+{
+    uint subscription, sectionId;
+    if (!submenuSection(parentId, subscription, sectionId))
+        return false;
+
+    if (!m_currentMenu->hasSubscription(subscription)) {
+        missingSubscriptions.insert(subscription);
+        m_preparingParents[subscription].insert(parentId);
+        return false;
+    }
+
+    // unchanged since we last built it, serve it right away
+    auto cacheIt = m_layoutCache.constFind(parentId);
+    if (cacheIt != m_layoutCache.constEnd() && cacheIt->propertyNames == propertyNames) {
+        level = *cacheIt;
+        markLayoutUsed(parentId);
+        return true;
+    }
+
+    level.propertyNames = propertyNames;
+    DBusMenuLayoutItem &dbusItem = level.layout;
+
+    // all sections this layout is built from, so we know when to throw it away again
+    QSet<uint> usedSections;
+    usedSections.insert(Utils::treeStructureToInt(subscription, sectionId, 0));
 
-    const auto itemsToBeAdded = section.items;
+    const MenuSection *section = m_currentMenu->getSection(subscription, sectionId);
+
+    if (!section) {
+        qDebug() << "There is no section" << sectionId << "on" << subscription;
+        return false;
+    }
+
+    dbusItem.id = parentId;
+    if (propertyNames.isEmpty() || propertyNames.contains(QLatin1String("children-display")))
+        dbusItem.properties.insert(QStringLiteral("children-display"), QStringLiteral("submenu"));
+
+    QVariantMap separatorProperties;
+    separatorProperties.insert(QStringLiteral("type"), QStringLiteral("separator"));
+    separatorProperties.insert(QStringLiteral("enabled"), true);
+    separatorProperties.insert(QStringLiteral("visible"), true);
+    if (!propertyNames.isEmpty()) {
+        for (auto it = separatorProperties.begin(); it != separatorProperties.end();) {
+            if (propertyNames.contains(it.key()))
+                ++it;
+            else
+                it = separatorProperties.erase(it);
+        }
+    }
+
+    const auto &itemsToBeAdded = section->items;
     const int count = itemsToBeAdded.count();
     int index = 0;
     for (const auto &item : itemsToBeAdded) {
         // Now resolve section aliases
-        auto it = item.constFind(QStringLiteral(":section"));
-        if (it != item.constEnd()) {//qDebug()<<subscription<<"\t"<<sectionId<<"\t"<<indexId<<"\t";
+        if (item.isSection()) {
             // references another place, add it instead
-            GMenuSection gmenuSection = it->value<GMenuSection>();
-            // remember where the item came from and give it an appropriate ID
-            // so updates signalled by the app will map to the right place
-            int originalSubscription = gmenuSection.subscription;
-            int originalMenu = gmenuSection.section;
-
-            // TODO start subscription if we don't have it
-            auto items = m_currentMenu->getSection(gmenuSection.subscription, gmenuSection.section).items;
-
-            // Check whether it's an alias to an alias
-            // FIXME make generic/recursive
-            while (items.count() == 1) {
-                const auto &aliasedItem = items.constFirst();
-                auto findIt = aliasedItem.constFind(QStringLiteral(":section"));
-                if (findIt != aliasedItem.constEnd()) {
-                    GMenuSection gmenuSection2 = findIt->value<GMenuSection>();
-                    items = m_currentMenu->getSection(gmenuSection2.subscription, gmenuSection2.section).items;
-
-                    originalSubscription = gmenuSection2.subscription;
-                    originalMenu = gmenuSection2.section;
-                    continue;
-                }
-
-                break;
+            const GMenuSection &gmenuSection = item.link;
+            // follow aliases to aliases, Menu remembers that until anything changes
+            const Menu::ResolvedSection resolved = m_currentMenu->resolveSection(gmenuSection.subscription, gmenuSection.section);
+            for (const GMenuSection &aliasSection : resolved.path) {
+                if (!m_currentMenu->hasSubscription(aliasSection.subscription))
+                    missingSubscriptions.insert(aliasSection.subscription);
+                usedSections.insert(Utils::treeStructureToInt(aliasSection.subscription, aliasSection.section, 0));
             }
 
-            int aliasedCount = 0;
-            for (const auto &aliasedItem : qAsConst(items)) {
-                DBusMenuLayoutItem aliasedChild{Utils::treeStructureToInt(originalSubscription, originalMenu, aliasedCount++), gMenuToDBusMenuProperties(aliasedItem), {}};
+            const MenuSection *aliasedSection = m_currentMenu->getSection(resolved.subscription, resolved.section);
+            const GMenuEntryList items = aliasedSection ? aliasedSection->items : GMenuEntryList();
+
+            for (const auto &aliasedItem : items) {
+                DBusMenuLayoutItem aliasedChild{aliasedItem.id, gMenuToDBusMenuProperties(aliasedItem, propertyNames), {}};
+                if (aliasedItem.isSubmenu())
+                    level.submenuIds.insert(aliasedChild.id);
+                recordSentProperties(aliasedChild.id, aliasedChild.properties, propertyNames);
                 dbusItem.children.append(aliasedChild);
             }
 
             if(count > 1 && index < count - 1)
             {
-                QVariantMap result;
-                result.insert(QStringLiteral("type"), QStringLiteral("separator"));
-                result.insert(QStringLiteral("enabled"), true);
-                result.insert(QStringLiteral("visible"), true);
-
-                DBusMenuLayoutItem child{Utils::treeStructureToInt(subscription, sectionId, index), result, {}};
+                // the section item itself stands in for the separator
+                DBusMenuLayoutItem child{item.id, separatorProperties, {}};
                 dbusItem.children.append(child);
             }
         }
@@ -536,8 +1060,25 @@ uint Window::GetLayout(int parentId, int recursionDepth, const QStringList &prop
         index++;
     }
 
-    // revision, unused in libdbusmenuqt
-    return 1;
+    cacheLayout(parentId, level, usedSections);
+    markLayoutUsed(parentId);
+
+    return true;
+}
+
+void Window::markLayoutUsed(int parentId)
+{
+    // keep what clients look at from being evicted, including what its sections alias into
+    QSet<uint> subscriptions;
+    const QSet<uint> sectionIds = m_layoutSections.value(parentId);
+    for (uint sectionId : sectionIds) {
+        int subscription, section, index;
+        Utils::intToTreeStructure(sectionId, subscription, section, index);
+        subscriptions.insert(subscription);
+    }
+
+    for (uint subscription : qAsConst(subscriptions))
+        m_currentMenu->markUsed(subscription);
 }
 
 QDBusVariant Window::GetProperty(int id, const QString &property)
@@ -545,17 +1086,10 @@ QDBusVariant Window::GetProperty(int id, const QString &property)
     QDBusVariant value;
 
     if (m_currentMenu && !property.isEmpty()) {
-        int subscription, sectionId, indexId;
-        Utils::intToTreeStructure(id, subscription, sectionId, indexId);
-
-        if (m_currentMenu->hasSubscription(subscription)) {
-            bool ok;
-            GMenuItem section = m_currentMenu->getSection(subscription, sectionId, &ok);
-
-            if (ok && (section.items.count() > indexId)) {
-                auto tmpItem = section.items.at(indexId);
-                value.setVariant(tmpItem.value(property, ""));
-            }
+        if (const GMenuEntry *item = m_currentMenu->getItem(id)) {
+            const QVariantMap properties = gMenuToDBusMenuProperties(*item, {property});
+            recordSentProperties(id, properties, {property});
+            value.setVariant(properties.value(property, QString()));
         }
     }
 
@@ -572,21 +1106,26 @@ uint Window::version() const
     return 4;
 }
 
-QVariantMap Window::gMenuToDBusMenuProperties(const QVariantMap &source) const
+QVariantMap Window::gMenuToDBusMenuProperties(const GMenuEntry &source, const QStringList &propertyNames) const
 {
     QVariantMap result;
 
-    result.insert(QStringLiteral("label"), source.value(QStringLiteral("label")).toString());
+    auto wants = [&propertyNames](const QLatin1String &property) {
+        return propertyNames.isEmpty() || propertyNames.contains(property);
+    };
+
+    if (wants(QLatin1String("label")))
+        result.insert(QStringLiteral("label"), source.label);
 
-    if (source.contains(QLatin1String(":section"))) {
+    if (wants(QLatin1String("type")) && source.isSection()) {
         result.insert(QStringLiteral("type"), QStringLiteral("separator"));
     }
 
-    const bool isMenu = source.contains(QLatin1String(":submenu"));
-    if (isMenu)
+    const bool isMenu = source.isSubmenu();
+    if (isMenu && wants(QLatin1String("children-display")))
         result.insert(QStringLiteral("children-display"), QStringLiteral("submenu"));
 
-    QString accel = source.value(QStringLiteral("accel")).toString();
+    QString accel = wants(QLatin1String("shortcut")) ? source.accel : QString();
     if (!accel.isEmpty()) {
         QStringList shortcut;
 
@@ -624,57 +1163,69 @@ QVariantMap Window::gMenuToDBusMenuProperties(const QVariantMap &source) const
         }
     }
 
+    const bool wantsEnabled = wants(QLatin1String("enabled"));
+    const bool wantsVisible = wants(QLatin1String("visible"));
+    const bool wantsIcon = wants(QLatin1String("icon-name"));
+    const bool wantsToggle = wants(QLatin1String("toggle-type")) || wants(QLatin1String("toggle-state"));
+
+    // everything below needs the action, don't bother looking it up if nobody asked
+    if (!wantsEnabled && !wantsVisible && !wantsIcon && !wantsToggle)
+        return result;
+
     bool enabled = true;
 
-    const QString actionName = Utils::itemActionName(source);
+    const QString &actionName = source.action;
 
-    GMenuAction action;
+    const GMenuAction *action = nullptr;
     // if no action is specified this is fine but if there is an action we don't have
     // disable the menu entry
     bool actionOk = true;
-    if (!actionName.isEmpty()) {
-        actionOk = getAction(actionName, action);
-        enabled = actionOk && action.enabled;
+    if (!actionName.isEmpty() && (wantsEnabled || wantsVisible || wantsToggle)) {
+        action = getAction(source);
+        actionOk = action;
+        enabled = action && action->enabled;
     }
 
     // we used to only send this if not enabled but then dbusmenuimporter does not
     // update the enabled state when it changes from disabled to enabled
-    result.insert(QStringLiteral("enabled"), enabled);
-
-    bool visible = true;
-    const QString hiddenWhen = source.value(QStringLiteral("hidden-when")).toString();
-    if (hiddenWhen == QLatin1String("action-disabled") && (!actionOk || !enabled))
-        visible = false;
-    else if (hiddenWhen == QLatin1String("action-missing") && !actionOk)
-        visible = false;
-    // While we have Global Menu we don't have macOS menu (where Quit, Help, etc is separate)
-    else if (hiddenWhen == QLatin1String("macos-menubar"))
-        visible = true;
-
-    result.insert(QStringLiteral("visible"), visible);
-
-    QString icon = source.value(QStringLiteral("icon")).toString();
-    if (icon.isEmpty())
-        icon = source.value(QStringLiteral("verb-icon")).toString();
-
-    if(icon.isEmpty())
-        icon = Icons::actionIcon(actionName);
+    if (wantsEnabled)
+        result.insert(QStringLiteral("enabled"), enabled);
+
+    if (wantsVisible) {
+        bool visible = true;
+        // "macos-menubar" never sets a flag: while we have Global Menu we don't have macOS menu
+        // (where Quit, Help, etc is separate)
+        if ((source.flags & GMenuEntry::HiddenWhenActionDisabled) && (!actionOk || !enabled))
+            visible = false;
+        else if ((source.flags & GMenuEntry::HiddenWhenActionMissing) && !actionOk)
+            visible = false;
+
+        result.insert(QStringLiteral("visible"), visible);
+    }
 
-    if (!icon.isEmpty())
-        result.insert(QStringLiteral("icon-name"), icon);
+    if (wantsIcon) {
+        QString icon = source.icon;
+        if(icon.isEmpty())
+            icon = Icons::actionIcon(actionName);
 
+        if (!icon.isEmpty())
+            result.insert(QStringLiteral("icon-name"), icon);
+    }
 
-    if (actionOk && !isMenu) {
-        const auto actionStates = action.state;
+    if (wantsToggle && action && !isMenu) {
+        const auto &actionStates = action->state;
         if (actionStates.count() == 1) {
             const auto &actionState = actionStates.first();
             if (actionState.type() == QVariant::Bool) {
-                result.insert(QStringLiteral("toggle-type"), QStringLiteral("checkmark"));
-                result.insert(QStringLiteral("toggle-state"), actionState.toBool() ? 1 : 0);
+                if (wants(QLatin1String("toggle-type")))
+                    result.insert(QStringLiteral("toggle-type"), QStringLiteral("checkmark"));
+                if (wants(QLatin1String("toggle-state")))
+                    result.insert(QStringLiteral("toggle-state"), actionState.toBool() ? 1 : 0);
             } else if (actionState.type() == QVariant::String) {
-                const QVariant target = source.value(QStringLiteral("target"));
-                result.insert(QStringLiteral("toggle-type"), QStringLiteral("radio"));
-                result.insert(QStringLiteral("toggle-state"), actionState == target ? 1 : 0);
+                if (wants(QLatin1String("toggle-type")))
+                    result.insert(QStringLiteral("toggle-type"), QStringLiteral("radio"));
+                if (wants(QLatin1String("toggle-state")))
+                    result.insert(QStringLiteral("toggle-state"), actionState == source.target ? 1 : 0);
             }
         }
     }
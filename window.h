@@ -21,8 +21,11 @@
 
 #include <QObject>
 #include <QDBusContext>
+#include <QDBusMessage>
+#include <QElapsedTimer>
 #include <QString>
 #include <QSet>
+#include <QSharedPointer>
 #include <QWindow> // for WId
 #include <QPair>
 
@@ -31,7 +34,9 @@
 #include "gdbusmenutypes_p.h"
 #include "dbusmenutypes_p.h"
 
+class QDBusServiceWatcher;
 class QDBusVariant;
+class QTimer;
 
 class Actions;
 class Menu;
@@ -76,7 +81,9 @@ public:
 
     // DBus
     bool AboutToShow(int id);
+    QList<int> AboutToShowGroup(const QList<int> &ids, QList<int> &idErrors);
     void Event(int id, const QString &eventId, const QDBusVariant &data, uint timestamp);
+    QList<int> EventGroup(const DBusMenuEventList &events);
     DBusMenuItemList GetGroupProperties(const QList<int> &ids, const QStringList &propertyNames);
     uint GetLayout(int parentId, int recursionDepth, const QStringList &propertyNames, DBusMenuLayoutItem &dbusItem);
     QDBusVariant GetProperty(int id, const QString &property);
@@ -96,21 +103,61 @@ signals:
 
 private:
     void initMenu();
+    void onActionsLoadFinished();
+    void logPhase(const char *phase) const;
 
     bool registerDBusObject();
+    void prefetchMenu();
     void updateWindowProperties();
 
-    bool getAction(const QString &name, GMenuAction &action) const;
-    void triggerAction(const QString &name, const QVariant &target, uint timestamp = 0);
-    Actions *getActionsForAction(const QString &name, QString &lookupName) const;
+    const GMenuAction *getAction(const GMenuEntry &item) const;
+    void triggerAction(const GMenuEntry &item, uint timestamp = 0);
+    Actions *getActionsForScope(quint8 scope) const;
+    void describeReferencedActions();
 
     void menuChanged(const QSet<uint> &menuIds);
     void menuItemsChanged(const QSet<uint> &itemIds);
+    void markItemsDirty(Menu *menu, const QSet<uint> &itemIds);
+    void menuItemsRemoved(const QSet<uint> &itemIds);
 
-    void onActionsChanged(const QStringList &dirty, const QString &prefix);
-    void onMenuSubscribed(uint id);
+    void scheduleUpdate();
+    void sendUpdates();
 
-    QVariantMap gMenuToDBusMenuProperties(const QVariantMap &source) const;
+    void onActionsChanged(const QVector<uint> &dirty, quint8 scope);
+    void onMenuSubscribed(uint id);
+    void onMenuUnsubscribed(uint id);
+    void onServiceUnregistered();
+
+    // One level of a layout as returned by GetLayout with a recursionDepth of 1
+    struct LayoutLevel
+    {
+        QStringList propertyNames; // what it was built for, empty means all
+        DBusMenuLayoutItem layout;
+        QSet<int> submenuIds; // children having a submenu of their own
+    };
+
+    void buildLayout(int parentId, int recursionDepth, const QStringList &propertyNames, DBusMenuLayoutItem &dbusItem, QSet<uint> &missingSubscriptions);
+    void buildLayout(int parentId, int recursionDepth, const QStringList &propertyNames, DBusMenuLayoutItem &dbusItem, QSet<uint> &missingSubscriptions, QSet<int> &parentIds);
+    bool layoutLevel(int parentId, const QStringList &propertyNames, LayoutLevel &level, QSet<uint> &missingSubscriptions);
+    // where the submenu of parentId is, false if it doesn't open one
+    bool submenuSection(int parentId, uint &subscription, uint &sectionId) const;
+    // what layoutLevel() would be missing, without building (and recording as sent) anything
+    bool findMissingSubscriptions(int parentId, QSet<uint> &missingSubscriptions) const;
+    // touches every subscription the cached layout of parentId is built from
+    void markLayoutUsed(int parentId);
+
+    void recordSentProperties(int id, const QVariantMap &properties, const QStringList &propertyNames);
+
+    void cacheLayout(int parentId, const LayoutLevel &level, const QSet<uint> &sectionIds);
+    // forgets which sections the layout of parentId was built from
+    void unlinkLayout(int parentId);
+    // return the parent ids whose layout contained any of the sections
+    QSet<int> invalidateLayouts(const QSet<uint> &sectionIds);
+    QSet<int> invalidateLayoutsForSubscription(uint subscription);
+    void clearLayoutCache();
+
+    // only computes the given properties, all of them if propertyNames is empty
+    QVariantMap gMenuToDBusMenuProperties(const GMenuEntry &source, const QStringList &propertyNames = QStringList()) const;
 
     WId m_winId = 0;
     QString m_serviceName; // original GMenu service (the gtk app)
@@ -125,17 +172,56 @@ private:
 
     QString m_proxyObjectPath; // our object path on this proxy app
 
-    QMultiHash<int, QDBusMessage> m_pendingGetLayouts;
-
-    Menu *m_applicationMenu = nullptr;
+    // A GetLayout request that waits for the subscriptions its tree needs
+    struct PendingGetLayout
+    {
+        QDBusMessage message;
+        int parentId;
+        int recursionDepth;
+        QStringList propertyNames;
+        QSet<uint> waitingFor;
+        QSet<uint> requested; // everything started for it, so failed subscriptions aren't retried
+        bool waitingForActions; // came in before the actions, see m_pendingActionLoads
+    };
+    QList<PendingGetLayout> m_pendingGetLayouts;
+    // builds the layout of the request and replies, or starts what it still misses and returns false
+    bool finishPendingLayout(PendingGetLayout &pending, QSet<uint> &nextSubscriptions);
+    // parents whose layout couldn't be built (or prepared by AboutToShow) for lack of a subscription,
+    // to signal them once it arrived
+    QHash<uint, QSet<int>> m_preparingParents;
+
+    // GetLayout results for the current menu keyed by parent id, and for every section
+    // (as tree structure id with index 0) the parent ids whose layout was ever built from it
+    QHash<int, LayoutLevel> m_layoutCache;
+    QHash<uint, QSet<int>> m_layoutCacheSections;
+    QHash<int, QSet<uint>> m_layoutSections; // the other way round, parent id to the sections
+
+    // changes not yet signalled, see scheduleUpdate()
+    QSet<uint> m_dirtyItems;
+    QSet<int> m_dirtyParents;
+    QTimer *m_updateTimer;
+
+    // the properties of every item as the client last got them, so we only need to send what changed
+    QHash<int, QVariantMap> m_sentProperties;
+
+    QSharedPointer<Menu> m_applicationMenu; // shared between all windows of the app, see Menu::shared()
     Menu *m_menuBar = nullptr;
 
     Menu *m_currentMenu = nullptr;
 
-    Actions *m_applicationActions = nullptr;
+    QSharedPointer<Actions> m_applicationActions; // shared as well
     Actions *m_unityActions = nullptr;
     Actions *m_windowActions = nullptr;
 
     bool m_menuInited = false;
+    // Actions load()ed by init() that neither loaded nor failed yet, layouts and updates wait for them
+    int m_pendingActionLoads = 0;
+    QElapsedTimer m_initTimer; // since init(), for logPhase()
+
+    QDBusServiceWatcher *m_serviceWatcher;
+
+    // bumped on every change to the structure of the exported menu,
+    // reported by GetLayout and LayoutUpdated so clients can tell whether their copy is current
+    uint m_revision = 1;
 
 };